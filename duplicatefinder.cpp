@@ -7,7 +7,42 @@
 #include "cmath"
 #include "dirent.h"
 #include "cstring"
+#include "strings.h"
 #include "chrono"
+#include "fstream"
+#include "iomanip"
+#include "sstream"
+#include "cerrno"
+#include "limits"
+#include "map"
+#include "set"
+#include "poll.h"
+#include "unistd.h"
+#include "sys/inotify.h"
+#include "sys/stat.h"
+#include "sys/xattr.h"
+#include "sys/mman.h"
+#include "sys/syscall.h"
+#include "sys/uio.h"
+#include "fcntl.h"
+#include "linux/io_uring.h"
+#include "linux/fs.h"
+#include "linux/fiemap.h"
+#include "sys/ioctl.h"
+#include "malloc.h"
+#include "csignal"
+#include "numeric"
+#if defined(__x86_64__) || defined(__i386__)
+#include "immintrin.h"
+#endif
+#include "functional"
+#include "deque"
+#include "queue"
+#include "thread"
+#include "mutex"
+#include "condition_variable"
+#include "memory"
+#include "atomic"
 
 using namespace cimg_library;
 using namespace std;
@@ -18,31 +53,691 @@ class Image{
         float averageBrightness;
         int width;
         int height;
+        long long previewOffset;//where the embedded JPEG preview of a RAW file starts, and its length (0 for other images)
+        long long previewLength;
+        long long fileSize;//the file's size and modification time when it was probed, so a rescan can spot rewrites
+        long long mtimeSeconds;
+        long long mtimeNanoseconds;
+        string thumbnail;//JPEG at most gridThumbnailLength on a side, for the match grid; empty when none was kept
         vector<vector<int>> smallProfile;
         vector<vector<int>> smallGrayscaleProfile;
 };
 
+//Directory metadata and listing from a previous run; reused while the directory's timestamps are unchanged
+class DirectorySnapshot{
+    public:
+        long long mtimeSeconds;
+        long long mtimeNanoseconds;
+        long long ctimeSeconds;
+        long long ctimeNanoseconds;
+        long long linkCount;
+        int entryCount;
+        long long scanTime;
+        vector<string> images;
+        vector<string> directories;
+};
+
+//One file being read by the I/O stage; its buffer is reused for later files unless it has grown past its share of
+//readMaxInFlightBytes
+class ReadSlot{
+    public:
+        size_t index;
+        int fileDescriptor;
+        size_t length;
+        size_t completed;
+        long long charge;//bytes held in the memory budget for this file, if there is one
+        struct iovec request;
+        vector<unsigned char> buffer;
+};
+
+class MappedFile{
+    public:
+        size_t index;
+        void* data;
+        size_t length;
+};
+
+//Bytes of file data and decoded images in memory at once across the decode threads
+class MemoryBudget{
+    public:
+        long long limit;
+        long long used;
+        mutex budgetMutex;
+        condition_variable released;
+        
+        MemoryBudget(long long limit) : limit(limit), used(0) {}
+        
+        //Waits until bytes fit; a request larger than the whole budget is admitted once nothing else is in use
+        void Acquire(long long bytes){
+            unique_lock<mutex> lock(budgetMutex);
+            released.wait(lock, [&](){ return used == 0 || used + bytes <= limit; });
+            used += bytes;
+        }
+        
+        //Acquire without waiting; false if bytes don't fit now
+        bool TryAcquire(long long bytes){
+            lock_guard<mutex> lock(budgetMutex);
+            if(used > 0 && used + bytes > limit){
+                return false;
+            }
+            used += bytes;
+            return true;
+        }
+        
+        void Release(long long bytes){
+            lock_guard<mutex> lock(budgetMutex);
+            used -= bytes;
+            released.notify_all();
+        }
+};
+
+//Display-ready images for the match viewer, decoded ahead of time by worker threads and kept in a least recently
+//used cache of at most capacity bytes.  Images are identified by file name.
+class ImagePrefetcher{
+    public:
+        typedef function<void(const Image& image, CImg<unsigned char>& cimg)> Loader;
+        
+        class Entry{
+            public:
+                shared_ptr<CImg<unsigned char>> cimg;//NULL while queued or being decoded
+                long long lastUse;
+        };
+        
+        Loader load;
+        long long capacity;
+        long long used;
+        long long useCounter;
+        bool isStopping;
+        map<string, Entry> entries;
+        deque<Image> queue;
+        mutex cacheMutex;
+        condition_variable changed;
+        vector<thread> workers;
+        
+        ImagePrefetcher(const Loader& load, long long capacity, int threadCount) : load(load), capacity(capacity), used(0), useCounter(0), isStopping(false) {
+            for(int i = 0; i < threadCount; i++){
+                workers.push_back(thread([this](){ Work(); }));
+            }
+        }
+        
+        ~ImagePrefetcher(){
+            {
+                lock_guard<mutex> lock(cacheMutex);
+                isStopping = true;
+                changed.notify_all();
+            }
+            for(thread& worker : workers){
+                worker.join();
+            }
+        }
+        
+        //Replaces whatever is still waiting with images, most wanted first, and marks them as recently used
+        void Prefetch(const vector<Image>& images){
+            lock_guard<mutex> lock(cacheMutex);
+            for(const Image& queued : queue){
+                entries.erase(queued.fileName);
+            }
+            queue.clear();
+            for(size_t i = images.size(); i-- > 0;){//so the first image ends up most recently used
+                map<string, Entry>::iterator entry = entries.find(images[i].fileName);
+                if(entry == entries.end()){
+                    entries[images[i].fileName] = Entry{NULL, ++useCounter};
+                    queue.push_front(images[i]);
+                }
+                else{
+                    entry->second.lastUse = ++useCounter;
+                }
+            }
+            changed.notify_all();
+        }
+        
+        //Waits for image if a worker is decoding it, and decodes it on this thread if nobody has started on it yet
+        shared_ptr<CImg<unsigned char>> Get(const Image& image){
+            unique_lock<mutex> lock(cacheMutex);
+            while(true){
+                map<string, Entry>::iterator entry = entries.find(image.fileName);
+                if(entry != entries.end() && entry->second.cimg != NULL){
+                    entry->second.lastUse = ++useCounter;
+                    return entry->second.cimg;
+                }
+                deque<Image>::iterator queued = find_if(queue.begin(), queue.end(), [&image](const Image& waiting){ return waiting.fileName == image.fileName; });
+                if(entry == entries.end() || queued != queue.end()){
+                    if(queued != queue.end()){
+                        queue.erase(queued);
+                    }
+                    entries[image.fileName] = Entry{NULL, ++useCounter};
+                    lock.unlock();
+                    return Decode(image);
+                }
+                changed.wait(lock);
+            }
+        }
+        
+        //The decoded image when it is ready, without waiting for it or decoding it
+        shared_ptr<CImg<unsigned char>> Find(const string& fileName){
+            lock_guard<mutex> lock(cacheMutex);
+            map<string, Entry>::iterator entry = entries.find(fileName);
+            if(entry == entries.end() || entry->second.cimg == NULL){
+                return NULL;
+            }
+            entry->second.lastUse = ++useCounter;
+            return entry->second.cimg;
+        }
+        
+        void Forget(const string& fileName){
+            lock_guard<mutex> lock(cacheMutex);
+            map<string, Entry>::iterator entry = entries.find(fileName);
+            if(entry != entries.end() && entry->second.cimg != NULL){
+                used -= entry->second.cimg->size();
+                entries.erase(entry);
+            }
+            changed.notify_all();
+        }
+        
+        void Work(){
+            unique_lock<mutex> lock(cacheMutex);
+            while(true){
+                changed.wait(lock, [this](){ return isStopping || queue.size() > 0; });
+                if(isStopping){
+                    return;
+                }
+                Image image = queue.front();
+                queue.pop_front();
+                lock.unlock();
+                Decode(image);
+                lock.lock();
+            }
+        }
+        
+        //Unreadable images become a black placeholder, as they always have in the viewer
+        shared_ptr<CImg<unsigned char>> Decode(const Image& image){
+            shared_ptr<CImg<unsigned char>> cimg = make_shared<CImg<unsigned char>>();
+            try{
+                load(image, *cimg);
+            }
+            catch(...){
+                cimg->assign(32, 32, 1, 3, 0);
+            }
+            
+            lock_guard<mutex> lock(cacheMutex);
+            map<string, Entry>::iterator entry = entries.find(image.fileName);
+            if(entry == entries.end() || entry->second.cimg != NULL){//no longer wanted
+                return cimg;
+            }
+            entry->second.cimg = cimg;
+            used += cimg->size();
+            //evict the least recently used decoded images, but never the one just decoded
+            while(used > capacity){
+                map<string, Entry>::iterator oldest = entries.end();
+                for(map<string, Entry>::iterator candidate = entries.begin(); candidate != entries.end(); ++candidate){
+                    if(candidate->second.cimg != NULL && candidate != entry && (oldest == entries.end() || candidate->second.lastUse < oldest->second.lastUse)){
+                        oldest = candidate;
+                    }
+                }
+                if(oldest == entries.end()){
+                    break;
+                }
+                used -= oldest->second.cimg->size();
+                entries.erase(oldest);
+            }
+            changed.notify_all();
+            return cimg;
+        }
+};
+
+//Single writer for streamed match output.  Comparison threads fill buffers of records and hand them over whole;
+//the writer thread appends and flushes each one, so readers of the file see matches while the scan runs and at most
+//a few buffers are held at once.
+class MatchWriter{
+    public:
+        FILE* file;
+        bool isFailed;
+        bool isClosing;
+        deque<string> pending;
+        mutex writerMutex;
+        condition_variable changed;
+        thread writer;
+        
+        MatchWriter(FILE* file) : file(file), isFailed(false), isClosing(false) {
+            writer = thread([this](){ Work(); });
+        }
+        
+        //Blocks while the writer is more than a few buffers behind
+        void Submit(string& buffer){
+            unique_lock<mutex> lock(writerMutex);
+            changed.wait(lock, [this](){ return pending.size() < 8; });
+            pending.push_back(string());
+            pending.back().swap(buffer);
+            changed.notify_all();
+        }
+        
+        //Writes out everything submitted and closes the file; false if any write failed
+        bool Close(){
+            {
+                lock_guard<mutex> lock(writerMutex);
+                isClosing = true;
+                changed.notify_all();
+            }
+            writer.join();
+            return fclose(file) == 0 && !isFailed;
+        }
+        
+        void Work(){
+            unique_lock<mutex> lock(writerMutex);
+            while(true){
+                changed.wait(lock, [this](){ return isClosing || pending.size() > 0; });
+                if(pending.size() == 0){
+                    return;
+                }
+                string buffer;
+                buffer.swap(pending.front());
+                pending.pop_front();
+                changed.notify_all();
+                lock.unlock();
+                isFailed |= fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size() || fflush(file) != 0;
+                lock.lock();
+            }
+        }
+};
+
+class IoUring{
+    public:
+        int fileDescriptor;
+        bool isSingleMapping;
+        void* submissionRing;
+        size_t submissionRingSize;
+        void* completionRing;
+        size_t completionRingSize;
+        size_t submissionEntriesSize;
+        unsigned* submissionTail;
+        unsigned* submissionMask;
+        unsigned* submissionArray;
+        struct io_uring_sqe* submissionEntries;
+        unsigned* completionHead;
+        unsigned* completionTail;
+        unsigned* completionMask;
+        struct io_uring_cqe* completionEntries;
+};
+
+typedef function<void(size_t index, const unsigned char* data, size_t length)> ReadCallback;
+typedef function<bool(long long offset, unsigned char* destination, size_t length)> ByteReader;
+
+//A match between two entries of the image table, 12 bytes with the similarity kept in hundredths of a percent
 class Pairing{
     public:
-        Image image1;
-        Image image2;
-        float similarity;
+        unsigned image1;
+        unsigned image2;
+        unsigned short similarity;
+        
+        Pairing() : image1(0), image2(0), similarity(0) {}
+        Pairing(unsigned image1, unsigned image2, float similarity) : image1(image1), image2(image2), similarity((unsigned short)lround(similarity * 100)) {}
+        
+        float GetSimilarity() const {
+            return similarity / 100.0f;
+        }
+        
+        //Sorted output order: most similar first, ties in image order
+        bool IsMoreSimilarThan(const Pairing& other) const {
+            if(similarity != other.similarity){
+                return similarity > other.similarity;
+            }
+            return image1 < other.image1 || (image1 == other.image1 && image2 < other.image2);
+        }
+};
+
+//Sorts matches into IsMoreSimilarThan order without holding them all.  Each comparison thread collects up to
+//runLength matches, bucket sorts them on the quantized similarity and spills them to a temporary file as one run;
+//Merge then streams a k-way merge of the runs.
+class MatchSorter{
+    public:
+        class Cursor{
+            public:
+                FILE* file;//NULL once an in-memory run is all in buffer
+                vector<Pairing> buffer;
+                size_t position;
+        };
+        
+        size_t runLength;
+        vector<Cursor> runs;
+        mutex runsMutex;
+        
+        MatchSorter(size_t runLength) : runLength(max((size_t)1, runLength)) {}
+        
+        ~MatchSorter(){
+            for(Cursor& run : runs){
+                if(run.file != NULL){
+                    fclose(run.file);
+                }
+            }
+        }
+        
+        //Stable counting sort on similarity, so a thread's row order settles ties; pairings is left sorted
+        static void Sort(vector<Pairing>& pairings){
+            vector<size_t> starts(10002, 0);
+            for(const Pairing& pairing : pairings){
+                starts[10000 - pairing.similarity + 1]++;
+            }
+            partial_sum(starts.begin(), starts.end(), starts.begin());
+            vector<Pairing> sorted(pairings.size());
+            for(const Pairing& pairing : pairings){
+                sorted[starts[10000 - pairing.similarity]++] = pairing;
+            }
+            pairings.swap(sorted);
+        }
+        
+        //Sorts pairings into a run of their own and empties it.  Runs go to a temporary file when one can be written,
+        //otherwise they stay in memory.
+        void AddRun(vector<Pairing>& pairings, bool isSpilled){
+            if(pairings.size() == 0){
+                return;
+            }
+            Sort(pairings);
+            Cursor run;
+            run.file = isSpilled ? tmpfile() : NULL;
+            run.position = 0;
+            if(run.file != NULL && (fwrite(pairings.data(), sizeof(Pairing), pairings.size(), run.file) != pairings.size() || fseek(run.file, 0, SEEK_SET) != 0)){
+                fclose(run.file);
+                run.file = NULL;
+            }
+            if(run.file == NULL){
+                run.buffer.swap(pairings);
+            }
+            pairings.clear();
+            lock_guard<mutex> lock(runsMutex);
+            runs.push_back(move(run));
+        }
+        
+        void Merge(const function<void(const Pairing&)>& emit){
+            auto isLessSimilar = [this](size_t a, size_t b){ return runs[b].buffer[runs[b].position].IsMoreSimilarThan(runs[a].buffer[runs[a].position]); };
+            priority_queue<size_t, vector<size_t>, decltype(isLessSimilar)> heads(isLessSimilar);
+            for(size_t i = 0; i < runs.size(); i++){
+                if(Refill(runs[i])){
+                    heads.push(i);
+                }
+            }
+            while(!heads.empty()){
+                size_t i = heads.top();
+                heads.pop();
+                emit(runs[i].buffer[runs[i].position++]);
+                if(Refill(runs[i])){
+                    heads.push(i);
+                }
+            }
+        }
+        
+        //False once the run is used up
+        bool Refill(Cursor& run){
+            if(run.position < run.buffer.size()){
+                return true;
+            }
+            if(run.file == NULL){
+                return false;
+            }
+            run.buffer.resize(4096);
+            run.buffer.resize(fread(run.buffer.data(), sizeof(Pairing), run.buffer.size(), run.file));
+            run.position = 0;
+            return run.buffer.size() > 0;
+        }
+};
+
+//Comparison tiles (runs of rows) that are finished, with the pairs they found, appended to a file as each tile
+//finishes so an interrupted run can resume.  The file is synced at most every syncMilliseconds; tiles finished since
+//the last sync are compared again after a crash.  After the header, each tile is a u32 tile index and u32 pair
+//count followed by that many 12-byte pairs: u32 indices and the similarity as a float, all little-endian.
+class ComparisonCheckpoint{
+    public:
+        class Entry{
+            public:
+                unsigned image1;
+                unsigned image2;
+                float similarity;
+        };
+        
+        FILE* file;
+        FILE* reader;
+        vector<long long> tileOffsets;//where each tile's pairs start in the file, -1 for tiles still to compare
+        vector<unsigned> tilePairCounts;
+        size_t completedTileCount;
+        long long syncMilliseconds;
+        chrono::steady_clock::time_point lastSync;
+        mutex fileMutex;
+        
+        ComparisonCheckpoint(long long syncMilliseconds) : file(NULL), reader(NULL), completedTileCount(0), syncMilliseconds(syncMilliseconds) {}
+        
+        //With resumes, tiles recorded after the same header are kept (a torn last tile is cut off); otherwise, or if the
+        //header differs, the file starts over
+        bool Open(const string& fileName, const string& header, size_t tileCount, bool resumes){
+            tileOffsets.assign(tileCount, -1);
+            tilePairCounts.assign(tileCount, 0);
+            long long validLength = 0;
+            struct stat fileInfo;
+            FILE* previous = resumes ? fopen(fileName.c_str(), "rb") : NULL;
+            if(previous != NULL && fstat(fileno(previous), &fileInfo) == 0){
+                string previousHeader(header.size(), 0);
+                if(fread(&previousHeader[0], 1, header.size(), previous) == header.size() && previousHeader == header){
+                    validLength = header.size();
+                    unsigned char tileHeader[8];
+                    while(fseek(previous, validLength, SEEK_SET) == 0 && fread(tileHeader, 1, 8, previous) == 8){
+                        size_t tile = GetUnsigned(tileHeader);
+                        unsigned pairCount = GetUnsigned(tileHeader + 4);
+                        long long end = validLength + 8 + pairCount * 12LL;
+                        if(tile >= tileCount || end > fileInfo.st_size){
+                            break;
+                        }
+                        if(tileOffsets[tile] < 0){
+                            completedTileCount++;
+                        }
+                        tileOffsets[tile] = validLength + 8;
+                        tilePairCounts[tile] = pairCount;
+                        validLength = end;
+                    }
+                }
+            }
+            if(previous != NULL){
+                fclose(previous);
+            }
+            
+            if(validLength > 0){
+                file = truncate(fileName.c_str(), validLength) == 0 ? fopen(fileName.c_str(), "ab") : NULL;
+            }
+            else{
+                file = fopen(fileName.c_str(), "wb");
+                if(file != NULL && fwrite(header.data(), 1, header.size(), file) != header.size()){
+                    fclose(file);
+                    file = NULL;
+                }
+            }
+            reader = file != NULL ? fopen(fileName.c_str(), "rb") : NULL;
+            lastSync = chrono::steady_clock::now();
+            return file != NULL && reader != NULL;
+        }
+        
+        bool IsComplete(size_t tile) const {
+            return tile < tileOffsets.size() && tileOffsets[tile] >= 0;
+        }
+        
+        void Complete(size_t tile, const vector<Entry>& pairs){
+            string buffer;
+            PutUnsigned(buffer, tile);
+            PutUnsigned(buffer, pairs.size());
+            for(const Entry& pair : pairs){
+                uint32_t similarityBits;
+                memcpy(&similarityBits, &pair.similarity, 4);
+                PutUnsigned(buffer, pair.image1);
+                PutUnsigned(buffer, pair.image2);
+                PutUnsigned(buffer, similarityBits);
+            }
+            lock_guard<mutex> lock(fileMutex);
+            fwrite(buffer.data(), 1, buffer.size(), file);
+            completedTileCount++;
+            if(chrono::steady_clock::now() - lastSync >= chrono::milliseconds(syncMilliseconds)){
+                Sync();
+            }
+        }
+        
+        //Pairs recorded for a tile finished by an earlier run
+        bool ReadTile(size_t tile, vector<Entry>& pairs){
+            vector<unsigned char> bytes(tilePairCounts[tile] * 12);
+            {
+                lock_guard<mutex> lock(fileMutex);
+                if(fseek(reader, tileOffsets[tile], SEEK_SET) != 0 || fread(bytes.data(), 1, bytes.size(), reader) != bytes.size()){
+                    return false;
+                }
+            }
+            pairs.resize(tilePairCounts[tile]);
+            for(size_t i = 0; i < pairs.size(); i++){
+                uint32_t similarityBits = GetUnsigned(&bytes[i * 12 + 8]);
+                pairs[i].image1 = GetUnsigned(&bytes[i * 12]);
+                pairs[i].image2 = GetUnsigned(&bytes[i * 12 + 4]);
+                memcpy(&pairs[i].similarity, &similarityBits, 4);
+            }
+            return true;
+        }
+        
+        //Caller holds fileMutex (or is the only thread left)
+        bool Sync(){
+            lastSync = chrono::steady_clock::now();
+            return fflush(file) == 0 && fdatasync(fileno(file)) == 0;
+        }
+        
+        bool Close(){
+            bool isSynced = Sync();
+            isSynced &= fclose(file) == 0;
+            fclose(reader);
+            return isSynced;
+        }
+        
+        static unsigned GetUnsigned(const unsigned char* bytes){
+            return bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (unsigned)bytes[3] << 24;
+        }
+        
+        static void PutUnsigned(string& buffer, unsigned value){
+            for(int i = 0; i < 4; i++){
+                buffer += (char)(value >> (8 * i));
+            }
+        }
+};
+
+enum ProfileStatus { profileCreated, profileTooSmall, profileFailed };
+enum BatchAction { batchActionNone, batchActionDelete, batchActionQuarantine, batchActionHardlink, batchActionReflink };
+const char* const batchActionNames[] = {"none", "delete", "quarantine", "hardlink", "reflink"};
+enum KeepPolicy { keepHighestResolution, keepOldest, keepShortestPath };
+enum OutputFormat { outputFormatJsonLines, outputFormatCsv, outputFormatBinary };
+const char* const outputFormatNames[] = {"jsonl", "csv", "binary"};
+enum ImageType { imageTypeNone, imageTypeJpeg, imageTypePng, imageTypeRaw, imageTypeCount };
+
+struct ImageExtension{
+    const char* suffix;
+    ImageType type;
+};
+
+//Matched case-insensitively against the end of each file name
+const ImageExtension imageExtensions[] = {
+    {".jpg", imageTypeJpeg},
+    {".jpeg", imageTypeJpeg},
+    {".jpe", imageTypeJpeg},
+    {".png", imageTypePng},
+    {".cr2", imageTypeRaw},
+    {".nef", imageTypeRaw},
+    {".arw", imageTypeRaw},
+    {".dng", imageTypeRaw},
 };
+const char* const imageTypeNames[imageTypeCount] = {"other", "JPEG", "PNG", "RAW"};
 
 vector<string> GetDirectoriesInDirectory(const string& path, bool isFirstLevel);
-vector<string> GetImagesInDirectory(const string& path, bool isFirstLevel);
 vector<string> GetImageList(string path, bool isRecursive);
+bool ScanDirectory(const string& path, bool isFirstLevel, DirectorySnapshot& snapshot);
+vector<vector<string>> FindExactDuplicates(vector<string>& files);
+bool HashFile(const string& fileName, size_t limit, unsigned long long& hash);
+unsigned long long HashBytes(const unsigned char* data, size_t length, unsigned long long seed);
+void LoadIndex(const string& fileName);
+void SaveIndex(const string& fileName);
 long long factorial(int x);
 float CompareProfiles(vector<vector<int>> image1, vector<vector<int>> image2);
-vector<vector<int>> CreateProfile(CImg<unsigned char> image, int resolution);
+vector<vector<int>> CreateProfile(const CImg<unsigned char>& image, int resolution);
+vector<vector<int>> CreateNearestProfile(const CImg<unsigned char>& image, int width, int height);
+vector<vector<int>> CreateAreaAverageProfile(const CImg<unsigned char>& image, int width, int height);
+unsigned long long SumBytesScalar(const unsigned char* data, size_t length);
+unsigned long long SumBytesAvx2(const unsigned char* data, size_t length);
+CImg<unsigned char> BoxDownsample(const CImg<unsigned char>& image, int width, int height);
 vector<vector<int>> CreateProfile2(CImg<unsigned char> image, int resolution);
 vector<float> ConvertToYUV(vector<int> colour);
 float GetColourSimilarity(vector<int> a, vector<int> b);
 float GetYUVColourSimilarity(vector<float> a, vector<float> b);
 float GetChannelSimilarity(int a, int b);
-void ShowMatches(vector<Pairing> matches);
+void ShowMatches(vector<Image>& images, const vector<Pairing>& matches, int firstMatch);
+void ShowMatchGrid(vector<Image>& images, const vector<Pairing>& matches);
+int RenderGridPage(CImg<unsigned char>& canvas, const vector<Image>& images, const vector<Pairing>& matches, int firstMatch, int columns, int rows, int selected, ImagePrefetcher& prefetcher);
+const CImg<unsigned char>* GetGridThumbnail(const Image& image);
+bool KeepsGridThumbnails();
+void StoreGridThumbnail(Image& image, const CImg<unsigned char>& cimg);
+void Redraw(CImgDisplay& display, const CImg<unsigned char>& image);
+void SetFullscreen(CImgDisplay& display, bool isFullscreen);
+void ReportRedrawTimes();
+void LoadForViewing(const Image& image, CImg<unsigned char>& cimg, int maximumWidth, int maximumHeight);
+void PrefetchAround(ImagePrefetcher& prefetcher, const vector<Image>& images, const vector<Pairing>& matches, int currentMatch);
 float GetAspectRatioPenalty(Image image1, Image image2);
 string GetTitle(Image img, bool isFirst, double similarity, int id);
+bool IsImageFileName(const string& name);
+ImageType GetImageType(const string& name);
+ImageType GetSignatureType(const unsigned char* data, size_t length);
+string JoinPath(const string& directory, const string& name);
+vector<Image> ProfileFiles(const vector<string>& files, vector<string>& ignoredImages, const set<string>& alwaysDecoded, bool skipsUnmatchable);
+ProfileStatus ProbeImage(const string& fileName, Image& image, const unsigned char* head, size_t headLength);
+ProfileStatus DecodeImageProfile(Image& image, const unsigned char* data, size_t length);
+bool ParseImageDimensions(const ByteReader& read, long long fileLength, int& width, int& height, long long& previewOffset, long long& previewLength);
+bool ParseJpegDimensions(const ByteReader& read, int& width, int& height, int& frameMarker);
+bool FindRawPreview(const ByteReader& read, long long fileLength, int& width, int& height, long long& previewOffset, long long& previewLength);
+bool ReadImageDimensions(const string& fileName, Image& image, const unsigned char* head, size_t headLength);
+bool ReadPreview(const Image& image, vector<unsigned char>& buffer);
+bool DecodeImageBuffer(const unsigned char* data, size_t length, CImg<unsigned char>& image, int minimumLength);
+bool DecodeJpeg(const unsigned char* data, size_t length, CImg<unsigned char>& image, int minimumLength);
+bool EncodeJpeg(const CImg<unsigned char>& image, int quality, string& output);
+bool FindExifThumbnail(const unsigned char* data, size_t length, const unsigned char*& thumbnail, size_t& thumbnailLength);
+bool ProfileFromExifThumbnail(Image& image, const unsigned char* head, size_t headLength);
+bool ProfileFromThumbnailCache(Image& image);
+bool ProfileFromThumbnail(Image& image, const CImg<unsigned char>& thumbnail);
+string GetFileUri(const string& fileName);
+vector<string> GetAbsolutePathSegments(const string& fileName);
+bool FindPngText(const unsigned char* data, size_t length, const string& keyword, string& text);
+string Md5Hex(const string& input);
+bool LoadStoredProfile(const string& fileName, Image& image);
+void RecordFileState(Image& image, const struct stat& fileInfo);
+bool StoreProfile(const Image& image);
+const char* GetProfileAttributeName();
+bool LoadStoredThumbnail(Image& image, const struct stat& fileInfo);
+void StoreThumbnail(const Image& image, const struct stat& fileInfo);
+bool DecodePng(const unsigned char* data, size_t length, CImg<unsigned char>& image);
+void ReadFiles(const vector<string>& fileNames, size_t readLimit, const ReadCallback& consume, MemoryBudget* budget, const vector<long long>& extraBytes);
+bool ReadFilesWithIoUring(const vector<string>& fileNames, const vector<size_t>& order, size_t readLimit, const ReadCallback& consume, MemoryBudget* budget, const vector<long long>& extraBytes);
+void ReadFilesWithThreads(const vector<string>& fileNames, const vector<size_t>& order, size_t readLimit, const ReadCallback& consume, MemoryBudget* budget, const vector<long long>& extraBytes);
+vector<size_t> GetPhysicalOrder(const vector<string>& fileNames);
+void MapFiles(const vector<string>& fileNames, const vector<size_t>& order, const ReadCallback& consume, MemoryBudget* budget, const vector<long long>& extraBytes);
+long long GetReadLength(const string& fileName, size_t readLimit);
+float GetAspectRatio(const Image& image);
+long long EstimateDecodeBytes(const Image& image);
+float GetMaximumAspectRatioDifference();
+float GetSimilarity(const Image& image1, const Image& image2);
+void WatchDirectory(const string& path, vector<Image>& images, vector<Pairing>& matches);
+void RunBatchActions(const vector<Image>& images, const vector<Pairing>& matches);
+void AppendMatchRecord(string& buffer, const Image& image1, const Image& image2, float similarity, unsigned index1, unsigned index2);
+string GetOutputHeader(const vector<Image>& images, const vector<Image>& copies);
+string EscapeJson(const string& text);
+string EscapeCsv(const string& text);
+void AppendLittleEndian(string& buffer, unsigned long long value, int byteCount);
+unsigned long long ReadLittleEndian(istream& input, int byteCount);
+bool WriteBand(const string& fileName, const vector<Image>& images, MatchSorter& sorter);
+int Rethreshold(const string& fileName);
+string GetCheckpointHeader(const vector<Image>& images, int recordedSimilarity);
+void StopComparisons(int signalNumber);
+void OfferMatches(vector<Image>& images, const vector<Pairing>& matches);
+vector<vector<Image>> GroupMatches(const vector<Image>& images, const vector<Pairing>& matches);
+size_t ChooseKeeper(const vector<Image>& group);
+bool ApplyBatchAction(const string& target, const string& keeper, string& error);
+bool ReplaceWithClone(const string& target, const string& keeper, string& error);
+bool HasSameContents(const string& fileName1, const string& fileName2);
+bool MoveFile(const string& source, const string& destination, string& error);
+bool MakeDirectories(const string& path);
 
 const float colourDifferencePenalty = 1.0;//0.78125f;
 const bool colourSimilarityUsesAverage = true;//true is less strict = higher percent similar
@@ -51,6 +746,7 @@ const bool isGrayscale = true;
 float yuvDiffPenalty = 1.3f;
 int minimumSimilarity = 90;
 
+bool usesAreaAverageProfile = true;//average every pixel into the profile grid rather than sampling one pixel per cell
 bool isSortedBySimilarity = false;
 bool isRecursive = true;//searches all sub directories
 bool usesAspectRatioPenalty = true;
@@ -59,37 +755,316 @@ int imageLimit = 700;
 float resolutionPenalty = 0;
 int imageMinimumLength = 4;
 string workingDirectory = "./";
+bool usesThumbnailProfile = false;//profile JPEGs from their EXIF thumbnail when it matches, otherwise from a scaled decode
+int scaledDecodeMinimumLength = 128;//smallest side a scaled JPEG decode may produce, so each profile cell still averages 8x8 pixels
+bool usesThumbnailCache = false;//profile from the freedesktop thumbnail cache when it holds an up to date thumbnail
+string thumbnailCacheDirectory = "";//$XDG_CACHE_HOME/thumbnails, or ~/.cache/thumbnails
+bool usesProfileAttributes = false;//keep each decoded profile in an extended attribute on its file and reuse it while the file is unchanged
+const unsigned char profileAttributeVersion = 1;
+bool isSniffing = false;//drop files whose first bytes, as read by the header probe, aren't a JPEG, PNG or TIFF signature
+bool usesExactDuplicatePass = true;//byte-identical files are grouped by size and hash, only one per group is decoded
+string indexFileName = "";//when set, directory snapshots are kept here so unchanged directories are not listed again
+int decodeThreadCount = max(1u, thread::hardware_concurrency());
+long long decodeMemoryBudget = 1LL << 30;//decoded bitmaps held at once by the decode threads
+bool usesIoUring = true;//otherwise the I/O stage uses a thread pool of blocking preads
+int readQueueDepth = 32;//files read at once by the I/O stage (each decode thread runs its own)
+long long readMaxInFlightBytes = 256LL << 20;//read but not yet decoded data an I/O stage may hold
+bool usesMmap = false;//whole-file reads map the file instead of copying it, so decoders read the page cache directly
+bool usesPhysicalOrder = false;//read files in on-disk order (FIEMAP extent, or inode number) to cut seeking on HDDs
+size_t probeReadLength = 64 << 10;//bytes read from the start of each file for header probes
+bool isWatching = false;//keep running and update images/matches from inotify events
+int watchDebounceMilliseconds = 250;//quiet period after the last event before a batch is applied
+int watchMaxBatchDelayMilliseconds = 750;//a continuous burst is still flushed this often
+int viewerPrefetchPairs = 3;//pairs either side of the shown one decoded ahead of time by the match viewer
+long long viewerCacheBytes = 128LL << 20;//decoded images the match viewer keeps
+int viewerPrefetchThreads = 2;
+bool usesMatchGrid = false;//browse matches as a contact sheet of thumbnails made while profiling
+const int gridThumbnailLength = 128;
+const int gridThumbnailQuality = 75;
+bool isTimingRedraws = false;//print how long the viewers' redraws take to reach the X server
+vector<double> redrawMilliseconds;
+
+unsigned long long (*const SumBytes)(const unsigned char*, size_t) =//picked while globals are initialised, hence the explicit cpu init
+#if defined(__x86_64__) || defined(__i386__)
+    (__builtin_cpu_init(), __builtin_cpu_supports("avx2")) ? SumBytesAvx2 : SumBytesScalar;
+#else
+    SumBytesScalar;
+#endif
+
+BatchAction batchAction = batchActionNone;//applied to every match group instead of asking to show matches
+KeepPolicy keepPolicy = keepHighestResolution;//which file of a group batchAction leaves alone
+string quarantineDirectory = "";//batchActionQuarantine moves files here, under their absolute path
+bool isDryRun = false;//print what batchAction would do without touching anything
+string journalFileName = "";//completed batch actions are appended here, and skipped when a run is resumed with it
+int batchThreadCount = 4;
+string outputFileName = "";//matches are streamed here as they are found, in outputFormat
+OutputFormat outputFormat = outputFormatJsonLines;
+const size_t outputBufferLength = 64 << 10;//bytes of records a comparison thread collects before handing them to the writer
+int compareThreadCount = max(1u, thread::hardware_concurrency());
+string bandFileName = "";//every pair above bandFloor is recorded here, so Rethreshold can try other thresholds without rescanning
+int bandFloor = 75;
+string rethresholdFileName = "";
+string checkpointFileName = "";//finished comparison tiles and their pairs are recorded here as the comparisons run
+bool isResuming = false;//keep the tiles checkpointFileName already holds instead of starting it over
+long long checkpointSyncMilliseconds = 30000;
+int compareTileRows = 16;//rows of the comparison handed to a thread, and checkpointed, at a time
+atomic<bool> isInterrupted(false);//set by SIGINT/SIGTERM while checkpointed comparisons run
+size_t topMatchCount = 0;//when set, only this many of the most similar matches are kept and output
+long long sortMemoryBudget = 256LL << 20;//bytes of matches held in memory by sorted output before runs spill to disk
 
 int matchesFound = 0;//for GetTitle
+map<string, DirectorySnapshot> directorySnapshots;//loaded from and saved to indexFileName
+int reusedDirectoryCount = 0;
+map<string, pair<unsigned long long, unsigned long long>> physicalLocations;//device and disk offset (or inode) per file, for GetPhysicalOrder
+mutex physicalLocationsMutex;
+map<string, CImg<unsigned char>> gridThumbnails;//Image::thumbnail decoded, per file, for ShowMatchGrid
 
 int main(int argc, char *argv[]) {
     //TODO: feature: check single image against a directory of images
     //TODO: feature: save profiles for faster future scans (checking modified date/hash to determine if updating needs to be done)
 
-    if(argc >= 2){
-        if(strcmp(argv[1], "0") == 0 || strcmp(argv[1], "false") == 0){
+    vector<string> arguments;//positional: [recursive] [directory]
+    for(int i = 1; i < argc; i++){
+        if(strcmp(argv[i], "--watch") == 0){
+            isWatching = true;
+        }
+        else if(strcmp(argv[i], "--nearest-profile") == 0){
+            usesAreaAverageProfile = false;
+        }
+        else if(strcmp(argv[i], "--thumbnail-profile") == 0){
+            usesThumbnailProfile = true;
+        }
+        else if(strcmp(argv[i], "--thumbnail-cache") == 0){
+            usesThumbnailCache = true;
+        }
+        else if(strcmp(argv[i], "--xattr-profiles") == 0){
+            usesProfileAttributes = true;
+        }
+        else if(strcmp(argv[i], "--sniff") == 0){
+            isSniffing = true;
+        }
+        else if(strcmp(argv[i], "--no-exact") == 0){
+            usesExactDuplicatePass = false;
+        }
+        else if(strcmp(argv[i], "--decode-threads") == 0 && i + 1 < argc){
+            decodeThreadCount = max(1, atoi(argv[++i]));
+        }
+        else if(strcmp(argv[i], "--memory-budget-mb") == 0 && i + 1 < argc){
+            decodeMemoryBudget = max(1LL, atoll(argv[++i])) << 20;
+        }
+        else if(strcmp(argv[i], "--mmap") == 0){
+            usesMmap = true;
+        }
+        else if(strcmp(argv[i], "--physical-order") == 0){
+            usesPhysicalOrder = true;
+        }
+        else if(strcmp(argv[i], "--no-io-uring") == 0){
+            usesIoUring = false;
+        }
+        else if(strcmp(argv[i], "--queue-depth") == 0 && i + 1 < argc){
+            readQueueDepth = max(1, atoi(argv[++i]));
+        }
+        else if(strcmp(argv[i], "--max-inflight-mb") == 0 && i + 1 < argc){
+            readMaxInFlightBytes = max(1LL, atoll(argv[++i])) << 20;
+        }
+        else if(strcmp(argv[i], "--output") == 0 && i + 1 < argc){
+            outputFileName = argv[++i];
+        }
+        else if(strcmp(argv[i], "--output-format") == 0 && i + 1 < argc){
+            string name = argv[++i];
+            int format = 0;
+            while(format <= outputFormatBinary && name != outputFormatNames[format]){
+                format++;
+            }
+            if(format > outputFormatBinary){
+                cout << "Unknown output format " << name << ".  Use jsonl, csv or binary.\n";
+                return 3;
+            }
+            outputFormat = (OutputFormat)format;
+        }
+        else if(strcmp(argv[i], "--similarity") == 0 && i + 1 < argc){
+            minimumSimilarity = max(0, min(100, atoi(argv[++i])));
+        }
+        else if(strcmp(argv[i], "--band") == 0 && i + 1 < argc){
+            bandFileName = argv[++i];
+        }
+        else if(strcmp(argv[i], "--band-floor") == 0 && i + 1 < argc){
+            bandFloor = max(0, min(100, atoi(argv[++i])));
+        }
+        else if(strcmp(argv[i], "--rethreshold") == 0 && i + 1 < argc){
+            rethresholdFileName = argv[++i];
+        }
+        else if(strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc){
+            checkpointFileName = argv[++i];
+        }
+        else if(strcmp(argv[i], "--checkpoint-seconds") == 0 && i + 1 < argc){
+            checkpointSyncMilliseconds = max(1, atoi(argv[++i])) * 1000LL;
+        }
+        else if(strcmp(argv[i], "--resume") == 0){
+            isResuming = true;
+        }
+        else if(strcmp(argv[i], "--sort") == 0){
+            isSortedBySimilarity = true;
+        }
+        else if(strcmp(argv[i], "--top") == 0 && i + 1 < argc){
+            topMatchCount = max(1, atoi(argv[++i]));
+            isSortedBySimilarity = true;
+        }
+        else if(strcmp(argv[i], "--sort-memory-mb") == 0 && i + 1 < argc){
+            sortMemoryBudget = max(1LL, atoll(argv[++i])) << 20;
+        }
+        else if(strcmp(argv[i], "--compare-threads") == 0 && i + 1 < argc){
+            compareThreadCount = max(1, atoi(argv[++i]));
+        }
+        else if(strcmp(argv[i], "--action") == 0 && i + 1 < argc){
+            string name = argv[++i];
+            for(int action = batchActionDelete; action <= batchActionReflink; action++){
+                if(name == batchActionNames[action]){
+                    batchAction = (BatchAction)action;
+                }
+            }
+            if(batchAction == batchActionNone){
+                cout << "Unknown action " << name << ".  Use delete, quarantine, hardlink or reflink.\n";
+                return 3;
+            }
+        }
+        else if(strcmp(argv[i], "--keep") == 0 && i + 1 < argc){
+            string name = argv[++i];
+            if(name == "resolution"){
+                keepPolicy = keepHighestResolution;
+            }
+            else if(name == "oldest"){
+                keepPolicy = keepOldest;
+            }
+            else if(name == "shortest-path"){
+                keepPolicy = keepShortestPath;
+            }
+            else{
+                cout << "Unknown keep policy " << name << ".  Use resolution, oldest or shortest-path.\n";
+                return 3;
+            }
+        }
+        else if(strcmp(argv[i], "--quarantine") == 0 && i + 1 < argc){
+            quarantineDirectory = argv[++i];
+        }
+        else if(strcmp(argv[i], "--dry-run") == 0){
+            isDryRun = true;
+        }
+        else if(strcmp(argv[i], "--journal") == 0 && i + 1 < argc){
+            journalFileName = argv[++i];
+        }
+        else if(strcmp(argv[i], "--action-threads") == 0 && i + 1 < argc){
+            batchThreadCount = max(1, atoi(argv[++i]));
+        }
+        else if(strcmp(argv[i], "--time-redraws") == 0){
+            isTimingRedraws = true;
+        }
+        else if(strcmp(argv[i], "--grid") == 0){
+            usesMatchGrid = true;
+        }
+        else if(strcmp(argv[i], "--prefetch-pairs") == 0 && i + 1 < argc){
+            viewerPrefetchPairs = max(0, atoi(argv[++i]));
+        }
+        else if(strcmp(argv[i], "--viewer-cache-mb") == 0 && i + 1 < argc){
+            viewerCacheBytes = max(1LL, atoll(argv[++i])) << 20;
+        }
+        else if(strcmp(argv[i], "--index") == 0 && i + 1 < argc){
+            indexFileName = argv[++i];
+        }
+        else{
+            arguments.push_back(argv[i]);
+        }
+    }
+
+    if(arguments.size() >= 1){
+        if(arguments[0].compare("0") == 0 || arguments[0].compare("false") == 0){
             isRecursive = false;
         }
     }
     
-    if(argc >= 3){
-        workingDirectory = argv[2];
+    if(arguments.size() >= 2){
+        workingDirectory = arguments[1];
         //TODO if last char isn't / then append one to the end
     }
 
     cimg_library::cimg::exception_mode(0);
     
+    //File buffers and decoded bitmaps are freed as soon as a decode is done.  A fixed threshold keeps them mapped
+    //so the memory goes back to the system; glibc would otherwise raise its threshold after the first large free and
+    //keep later buffers in each decode thread's arena, beyond what the memory budget accounts for.
+    mallopt(M_MMAP_THRESHOLD, 1 << 20);
+    
+    if(batchAction == batchActionQuarantine && quarantineDirectory.size() == 0){
+        cout << "--action quarantine needs --quarantine <directory>.  Exiting.\n";
+        return 3;
+    }
+    
+    if(rethresholdFileName.size() > 0){
+        return Rethreshold(rethresholdFileName);
+    }
+    
+    if(isResuming && checkpointFileName.size() == 0){
+        cout << "--resume needs --checkpoint <file>.  Exiting.\n";
+        return 3;
+    }
+    
+    if(usesThumbnailCache){
+        const char* cacheHome = getenv("XDG_CACHE_HOME");
+        const char* home = getenv("HOME");
+        if(cacheHome != NULL && cacheHome[0] == '/'){
+            thumbnailCacheDirectory = string(cacheHome) + "/thumbnails/";
+        }
+        else if(home != NULL){
+            thumbnailCacheDirectory = string(home) + "/.cache/thumbnails/";
+        }
+        else{
+            usesThumbnailCache = false;
+        }
+    }
+    
     chrono::high_resolution_clock::time_point t1 = chrono::high_resolution_clock::now();
 
     cout << "Searching directory \"" << workingDirectory << "\"...\n";
     
+    if(indexFileName.size() > 0){
+        LoadIndex(indexFileName);
+    }
+    
     vector<string> files = GetImageList(workingDirectory, isRecursive);
     
-    if(files.size() < 2){
+    if(indexFileName.size() > 0){
+        cout << "Reused " << reusedDirectoryCount << " unchanged directory listing(s) from " << indexFileName << ".\n";
+        SaveIndex(indexFileName);
+    }
+    
+    //With --sniff, files are checked against their signatures later, from the bytes read by the header probe
+    int typeCounts[imageTypeCount] = {};
+    for(const string& fileName : files){
+        typeCounts[GetImageType(fileName)]++;
+    }
+    cout << files.size() << " image(s) found (" << typeCounts[imageTypeJpeg] << " " << imageTypeNames[imageTypeJpeg] << ", " << typeCounts[imageTypePng] << " " << imageTypeNames[imageTypePng]
+        << ", " << typeCounts[imageTypeRaw] << " " << imageTypeNames[imageTypeRaw] << ").\n";
+    
+    if(files.size() < 2 && !isWatching){
         cout << files.size() << " image(s) found.  Minimum is 2.  Exiting.\n";
         return 1;
     }
     
+    vector<vector<string>> exactDuplicates;
+    if(usesExactDuplicatePass){
+        exactDuplicates = FindExactDuplicates(files);
+        for(const vector<string>& group : exactDuplicates){
+            cout << "Identical:";
+            for(const string& fileName : group){
+                cout << " " << fileName;
+            }
+            cout << "\n";
+        }
+        if(exactDuplicates.size() > 0){
+            cout << exactDuplicates.size() << " group(s) of byte-identical files found.  " << files.size() << " distinct files remain.\n";
+        }
+    }
+    
     if(files.size() > imageLimit){
         cout << files.size() << " images found.  Limit is " << imageLimit << ".  Exiting.\n";
         return 2;
@@ -97,31 +1072,57 @@ int main(int argc, char *argv[]) {
     
     cout << files.size() << " images found.  Generating image profiles...\n";
     
-    //Create smallProfiles for all images
-    vector<Image> images;
+    set<string> representatives;
+    for(const vector<string>& group : exactDuplicates){
+        representatives.insert(group[0]);
+    }
     vector<string> ignoredImages;
-    for(string fileName : files){
-        try{
-            CImg<unsigned char> tempCImg(fileName.c_str());
-        
-            if(tempCImg.width() < imageMinimumLength || tempCImg.height() < imageMinimumLength){
-                ignoredImages.push_back(fileName);
-            }
-            else{
-                Image newImage;
-                newImage.fileName = fileName;
-                newImage.height = tempCImg.height();
-                newImage.width = tempCImg.width();
-                newImage.smallProfile = CreateProfile(tempCImg, 1);
-                images.push_back(newImage);
+    vector<Image> images = ProfileFiles(files, ignoredImages, representatives, !isWatching);
+    
+    //With a streamed output and nothing else to use them for, matches are written out rather than kept
+    bool keepsMatches = outputFileName.size() == 0 || isWatching || batchAction != batchActionNone;
+    long long matchCount = 0;
+    
+    //Each identical copy is a 100% match of its group's profiled representative.  Copies join the end of the image
+    //table once the comparisons are done, so their indices are images.size() onwards.
+    vector<Pairing> matches;
+    vector<Image> copies;
+    vector<Pairing> copyMatches;
+    for(const vector<string>& group : exactDuplicates){
+        vector<Image>::iterator representative = find_if(images.begin(), images.end(), [&group](const Image& image){ return image.fileName == group[0]; });
+        if(representative == images.end()){
+            continue;
+        }
+        for(size_t i = 1; i < group.size(); i++){
+            copies.push_back(*representative);
+            copies.back().fileName = group[i];
+            struct stat fileInfo;
+            if(stat(group[i].c_str(), &fileInfo) == 0){
+                RecordFileState(copies.back(), fileInfo);
             }
+            copyMatches.push_back(Pairing(representative - images.begin(), images.size() + copies.size() - 1, 100));
+            matchCount++;
         }
-        catch(CImgIOException e){
-            cout << fileName << " has caused an error.  It may not be a valid image file.  Skipping...\n";
+    }
+    
+    MatchWriter* matchWriter = NULL;
+    if(outputFileName.size() > 0){
+        FILE* outputFile = fopen(outputFileName.c_str(), outputFormat == outputFormatBinary ? "wb" : "w");
+        if(outputFile == NULL){
+            cout << "Unable to open " << outputFileName << " for writing.  Exiting.\n";
+            return 3;
         }
-        catch(...){
-            cout << fileName << " has caused an error.  Skipping...\n";
+        matchWriter = new MatchWriter(outputFile);
+        string buffer = GetOutputHeader(images, copies);
+        for(const Pairing& copyMatch : copyMatches){
+            if(!isSortedBySimilarity){
+                AppendMatchRecord(buffer, images[copyMatch.image1], copies[copyMatch.image2 - images.size()], 100, copyMatch.image1, copyMatch.image2);
+            }
         }
+        matchWriter->Submit(buffer);
+    }
+    if(keepsMatches && !isSortedBySimilarity){
+        matches = copyMatches;
     }
     
     if(ignoredImages.size() > 0){
@@ -133,43 +1134,382 @@ int main(int argc, char *argv[]) {
     chrono::high_resolution_clock::time_point t2 = chrono::high_resolution_clock::now();
     auto profileGenerationDuration = chrono::duration_cast<chrono::microseconds>(t2 - t1).count();
     
-    //Compare smallProfiles for matches to add to firstPass
-    //TODO: look into doing this in parallel
-    vector<Pairing> matches;
-    for(int i = 0; i < images.size(); i++){
-        for(int j = i + 1; j < images.size(); j++){
-            float similarity = CompareProfiles(images[i].smallProfile, images[j].smallProfile);
-            
-            if(usesAspectRatioPenalty){
-                float penaltyMultiplier = GetAspectRatioPenalty(images[i], images[j]);
-                similarity *= penaltyMultiplier;
-            }
-            
-            if(similarity > minimumSimilarity){
-                //cout << images[i].fileName << " and " << images[j].fileName << " are " << similarity << " % similar.\n";
-                //TODO: sort by similarity before outputting? -- use an option to determine sorting
-                Pairing newPairing;
-                newPairing.image1 = images[i];
-                newPairing.image2 = images[j];
-                newPairing.similarity = similarity;
-                matches.push_back(newPairing);
-            }
+    //Compare smallProfiles for matches.  Tiles of compareTileRows rows are handed out to compareThreadCount threads;
+    //each keeps its own matches per row (merged back in row order afterwards) and its own output buffer.  Sorted
+    //output instead goes through each thread's bounded heap (--top) or sorted runs, and is written once the
+    //comparisons are done.  With a checkpoint, tiles an earlier run finished are replayed from it, not compared.
+    float maximumAspectRatioDifference = GetMaximumAspectRatioDifference();
+    int threadCount = max(1, min(compareThreadCount, (int)images.size()));
+    vector<vector<Pairing>> rowMatches(keepsMatches && !isSortedBySimilarity ? images.size() : 0);
+    atomic<long long> comparedMatchCount(0);
+    MatchSorter sorter(sortMemoryBudget / threadCount / sizeof(Pairing));
+    MatchSorter bandSorter(sortMemoryBudget / threadCount / sizeof(Pairing));
+    bool isBanding = bandFileName.size() > 0;
+    auto isLessSimilar = [](const Pairing& a, const Pairing& b){ return a.IsMoreSimilarThan(b); };
+    typedef priority_queue<Pairing, vector<Pairing>, decltype(isLessSimilar)> TopMatches;//least similar on top
+    vector<TopMatches> topMatches(threadCount, TopMatches(isLessSimilar));
+    int recordedSimilarity = isBanding ? min(minimumSimilarity, bandFloor) : minimumSimilarity;
+    size_t tileCount = (images.size() + compareTileRows - 1) / compareTileRows;
+    atomic<size_t> nextTile(0);
+    ComparisonCheckpoint checkpoint(checkpointSyncMilliseconds);
+    bool isCheckpointing = checkpointFileName.size() > 0;
+    if(isCheckpointing){
+        if(!checkpoint.Open(checkpointFileName, GetCheckpointHeader(images, recordedSimilarity), tileCount, isResuming)){
+            cout << "Unable to write the checkpoint " << checkpointFileName << ".  Exiting.\n";
+            return 3;
         }
+        if(isResuming){
+            cout << "Resuming with " << checkpoint.completedTileCount << " of " << tileCount << " tiles already compared.\n";
+        }
+        signal(SIGINT, StopComparisons);
+        signal(SIGTERM, StopComparisons);
     }
-
+    auto compareTiles = [&](int threadIndex){
+        string buffer;
+        vector<Pairing> run;
+        vector<Pairing> bandRun;
+        vector<ComparisonCheckpoint::Entry> tilePairs;
+        TopMatches& top = topMatches[threadIndex];
+        long long localMatchCount = 0;
+        auto addPair = [&](int i, int j, float similarity){
+            if(isBanding && similarity > bandFloor){
+                bandRun.push_back(Pairing(i, j, similarity));
+                if(bandRun.size() >= bandSorter.runLength){
+                    bandSorter.AddRun(bandRun, true);
+                }
+            }
+            if(similarity > minimumSimilarity){
+                localMatchCount++;
+                if(topMatchCount > 0){
+                    Pairing pairing(i, j, similarity);
+                    if(top.size() < topMatchCount){
+                        top.push(pairing);
+                    }
+                    else if(pairing.IsMoreSimilarThan(top.top())){
+                        top.pop();
+                        top.push(pairing);
+                    }
+                }
+                else if(isSortedBySimilarity){
+                    run.push_back(Pairing(i, j, similarity));
+                    if(run.size() >= sorter.runLength){
+                        sorter.AddRun(run, true);
+                    }
+                }
+                else if(matchWriter != NULL){
+                    AppendMatchRecord(buffer, images[i], images[j], similarity, i, j);
+                    if(buffer.size() >= outputBufferLength){
+                        matchWriter->Submit(buffer);
+                    }
+                }
+                if(keepsMatches && !isSortedBySimilarity){
+                    rowMatches[i].push_back(Pairing(i, j, similarity));
+                }
+            }
+        };
+        
+        for(size_t tile = nextTile++; tile < tileCount && !isInterrupted; tile = nextTile++){
+            if(checkpoint.IsComplete(tile) && checkpoint.ReadTile(tile, tilePairs)){
+                for(const ComparisonCheckpoint::Entry& pair : tilePairs){
+                    addPair(pair.image1, pair.image2, pair.similarity);
+                }
+                continue;
+            }
+            tilePairs.clear();
+            int lastRow = min(images.size(), (tile + 1) * compareTileRows);
+            //images is in aspect ratio order, so the inner loop stops once the aspect ratio penalty alone rules out a match
+            for(int i = tile * compareTileRows; i < lastRow; i++){
+                for(int j = i + 1; j < images.size() && GetAspectRatio(images[j]) - GetAspectRatio(images[i]) <= maximumAspectRatioDifference; j++){
+                    float similarity = GetSimilarity(images[i], images[j]);
+                    if(similarity > recordedSimilarity){
+                        addPair(i, j, similarity);
+                        if(isCheckpointing){
+                            ComparisonCheckpoint::Entry pair = {(unsigned)i, (unsigned)j, similarity};
+                            tilePairs.push_back(pair);
+                        }
+                    }
+                }
+            }
+            if(isCheckpointing){
+                checkpoint.Complete(tile, tilePairs);
+            }
+        }
+        if(matchWriter != NULL && buffer.size() > 0){
+            matchWriter->Submit(buffer);
+        }
+        //the last, partial run stays in memory
+        sorter.AddRun(run, false);
+        bandSorter.AddRun(bandRun, false);
+        comparedMatchCount += localMatchCount;
+    };
+    
+    vector<thread> compareThreads;
+    for(int t = 1; t < threadCount; t++){
+        compareThreads.push_back(thread(compareTiles, t));
+    }
+    compareTiles(0);
+    for(thread& worker : compareThreads){
+        worker.join();
+    }
+    if(isCheckpointing){
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        size_t completedTileCount = checkpoint.completedTileCount;
+        if(!checkpoint.Close()){
+            cout << "Unable to write the checkpoint " << checkpointFileName << ".\n";
+        }
+        if(isInterrupted){
+            if(matchWriter != NULL){
+                matchWriter->Close();
+                delete matchWriter;
+            }
+            cout << "Interrupted with " << completedTileCount << " of " << tileCount << " tiles compared.  Run again with --checkpoint " << checkpointFileName << " --resume to continue.\n";
+            return 130;
+        }
+    }
+    for(vector<Pairing>& row : rowMatches){
+        matches.insert(matches.end(), row.begin(), row.end());
+        vector<Pairing>().swap(row);
+    }
+    matchCount += comparedMatchCount;
+    if(isBanding){
+        vector<Pairing> bandCopies = copyMatches;
+        sort(bandCopies.begin(), bandCopies.end(), [](const Pairing& a, const Pairing& b){ return a.IsMoreSimilarThan(b); });
+        bandSorter.AddRun(bandCopies, false);
+    }
+    
+    if(topMatchCount > 0){
+        for(TopMatches& top : topMatches){
+            for(; !top.empty(); top.pop()){
+                copyMatches.push_back(top.top());
+            }
+        }
+        sort(copyMatches.begin(), copyMatches.end(), isLessSimilar);
+        copyMatches.resize(min(copyMatches.size(), topMatchCount));
+    }
+    if(isSortedBySimilarity){
+        //exact copies, or with --top everything kept, make one more run.  Copies are not in row order, so they are
+        //put in full IsMoreSimilarThan order first.
+        sort(copyMatches.begin(), copyMatches.end(), isLessSimilar);
+        sorter.AddRun(copyMatches, false);
+        string buffer;
+        sorter.Merge([&](const Pairing& pairing){
+            if(matchWriter != NULL){
+                const Image& image2 = pairing.image2 < images.size() ? images[pairing.image2] : copies[pairing.image2 - images.size()];
+                AppendMatchRecord(buffer, images[pairing.image1], image2, pairing.GetSimilarity(), pairing.image1, pairing.image2);
+                if(buffer.size() >= outputBufferLength){
+                    matchWriter->Submit(buffer);
+                }
+            }
+            if(keepsMatches){
+                matches.push_back(pairing);
+            }
+        });
+        if(matchWriter != NULL && buffer.size() > 0){
+            matchWriter->Submit(buffer);
+        }
+    }
+    images.insert(images.end(), copies.begin(), copies.end());
+    if(isBanding && !WriteBand(bandFileName, images, bandSorter)){
+        cout << "Unable to write the similarity band to " << bandFileName << ".\n";
+    }
+
     cout << "Profile generation took " << profileGenerationDuration / (float)1000000 << " seconds.\n";
     //TODO add duration for comparisons
-    cout << matches.size() << " matches found.\n";
+    cout << matchCount << " matches found.\n";
+    if(topMatchCount > 0 && matchCount > (long long)topMatchCount){
+        cout << "Keeping the " << topMatchCount << " most similar.\n";
+    }
+    
+    if(matchWriter != NULL){
+        bool isWritten = matchWriter->Close();
+        delete matchWriter;
+        if(!isWritten){
+            cout << "Unable to write all matches to " << outputFileName << ".\n";
+            return 3;
+        }
+        cout << "Matches written to " << outputFileName << ".\n";
+        if(!keepsMatches){
+            return 0;
+        }
+    }
+    
+    if(isWatching){
+        WatchDirectory(workingDirectory, images, matches);
+        return 0;
+    }
+    
+    OfferMatches(images, matches);
+    return 0;
+}
+
+//Runs the batch action on matches, or offers to show them
+void OfferMatches(vector<Image>& images, const vector<Pairing>& matches){
+    if(batchAction != batchActionNone){
+        RunBatchActions(images, matches);
+        return;
+    }
     
     if(matches.size() > 0){
         string showMatchesResponse;
         cout << "Show matches? (y/n)\n";
         cin >> showMatchesResponse;
-        if(showMatchesResponse.compare("y") == 0){
-            ShowMatches(matches);
+        if(showMatchesResponse.compare("y") == 0 && usesMatchGrid){
+            ShowMatchGrid(images, matches);
+        }
+        else if(showMatchesResponse.compare("y") == 0){
+            ShowMatches(images, matches, 0);
+        }
+    }
+}
+
+//A band file is "DDB2", the floor (u16), 100 u64 counts of the pairs whose similarity is above each whole percent
+//and at most the next, then the image table (u32 width, u32 height, u64 preview offset and length, u16 name length
+//and name, u32 thumbnail length and JPEG thumbnail) and a u64 pair count.  Pairs follow most similar first as
+//10-byte records: u32 indices and similarity in hundredths of a percent (u16).  Everything is little-endian.
+//"DDB1" files are the same without thumbnails.
+bool WriteBand(const string& fileName, const vector<Image>& images, MatchSorter& sorter){
+    FILE* file = fopen(fileName.c_str(), "wb");
+    if(file == NULL){
+        return false;
+    }
+    vector<unsigned long long> counts(100, 0);
+    unsigned long long pairCount = 0;
+    string buffer;
+    bool isWritten = true;
+    auto writeHeader = [&](){
+        buffer = "DDB2";
+        AppendLittleEndian(buffer, bandFloor, 2);
+        for(unsigned long long count : counts){
+            AppendLittleEndian(buffer, count, 8);
+        }
+        AppendLittleEndian(buffer, images.size(), 4);
+        for(const Image& image : images){
+            AppendLittleEndian(buffer, image.width, 4);
+            AppendLittleEndian(buffer, image.height, 4);
+            AppendLittleEndian(buffer, image.previewOffset, 8);
+            AppendLittleEndian(buffer, image.previewLength, 8);
+            AppendLittleEndian(buffer, image.fileName.size(), 2);
+            buffer += image.fileName;
+            AppendLittleEndian(buffer, image.thumbnail.size(), 4);
+            buffer += image.thumbnail;
+        }
+        AppendLittleEndian(buffer, pairCount, 8);
+        isWritten &= fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+        buffer.clear();
+    };
+    
+    //written once to hold the place, and again over it once the counts are known
+    writeHeader();
+    sorter.Merge([&](const Pairing& pairing){
+        AppendLittleEndian(buffer, pairing.image1, 4);
+        AppendLittleEndian(buffer, pairing.image2, 4);
+        AppendLittleEndian(buffer, pairing.similarity, 2);
+        counts[min(99, max(0, (pairing.similarity - 1) / 100))]++;
+        pairCount++;
+        if(buffer.size() >= outputBufferLength){
+            isWritten &= fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+            buffer.clear();
+        }
+    });
+    isWritten &= fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+    isWritten &= fseek(file, 0, SEEK_SET) == 0;
+    writeHeader();
+    isWritten &= fclose(file) == 0;
+    if(isWritten){
+        cout << pairCount << " pair(s) above " << bandFloor << "% written to " << fileName << ".\n";
+    }
+    return isWritten;
+}
+
+//Matches from a band file at minimumSimilarity, without rescanning.  The pairs are most similar first, so only
+//those above the threshold are read.
+int Rethreshold(const string& fileName){
+    ifstream band(fileName.c_str(), ios::binary);
+    char magic[4] = {};
+    band.read(magic, 4);
+    if(!band || (memcmp(magic, "DDB1", 4) != 0 && memcmp(magic, "DDB2", 4) != 0)){
+        cout << fileName << " is not a similarity band file.  Exiting.\n";
+        return 3;
+    }
+    bool hasThumbnails = magic[3] == '2';
+    int floor = ReadLittleEndian(band, 2);
+    vector<unsigned long long> counts(100);
+    for(unsigned long long& count : counts){
+        count = ReadLittleEndian(band, 8);
+    }
+    vector<Image> images(ReadLittleEndian(band, 4));
+    for(Image& image : images){
+        image.width = ReadLittleEndian(band, 4);
+        image.height = ReadLittleEndian(band, 4);
+        image.previewOffset = ReadLittleEndian(band, 8);
+        image.previewLength = ReadLittleEndian(band, 8);
+        image.fileName.resize(ReadLittleEndian(band, 2));
+        band.read(&image.fileName[0], image.fileName.size());
+        if(hasThumbnails){
+            image.thumbnail.resize(ReadLittleEndian(band, 4));
+            band.read(&image.thumbnail[0], image.thumbnail.size());
+        }
+    }
+    unsigned long long pairCount = ReadLittleEndian(band, 8);
+    if(!band){
+        cout << fileName << " is truncated.  Exiting.\n";
+        return 3;
+    }
+    
+    cout << images.size() << " images and " << pairCount << " pair(s) above " << floor << "% in " << fileName << ".\n";
+    cout << "Threshold  Matches\n";
+    unsigned long long atThreshold = 0;
+    for(int threshold = 99; threshold >= floor; threshold--){
+        atThreshold += counts[threshold];
+        cout << "      " << setw(3) << threshold << "  " << atThreshold << "\n";
+    }
+    if(minimumSimilarity < floor){
+        cout << "The band only holds pairs above " << floor << "%, so matches between " << minimumSimilarity << "% and " << floor << "% are missing.\n";
+    }
+    
+    vector<Pairing> matches;
+    unsigned short threshold = minimumSimilarity * 100;
+    for(unsigned long long i = 0; i < pairCount; i++){
+        Pairing pairing;
+        pairing.image1 = ReadLittleEndian(band, 4);
+        pairing.image2 = ReadLittleEndian(band, 4);
+        pairing.similarity = ReadLittleEndian(band, 2);
+        if(!band || pairing.similarity <= threshold){
+            break;
+        }
+        if(pairing.image1 < images.size() && pairing.image2 < images.size()){
+            matches.push_back(pairing);
+        }
+    }
+    cout << matches.size() << " matches above " << minimumSimilarity << "% in " << GroupMatches(images, matches).size() << " group(s).\n";
+    
+    if(outputFileName.size() > 0){
+        FILE* outputFile = fopen(outputFileName.c_str(), outputFormat == outputFormatBinary ? "wb" : "w");
+        if(outputFile == NULL){
+            cout << "Unable to open " << outputFileName << " for writing.  Exiting.\n";
+            return 3;
+        }
+        MatchWriter matchWriter(outputFile);
+        string buffer = GetOutputHeader(images, vector<Image>());
+        for(const Pairing& pairing : matches){
+            AppendMatchRecord(buffer, images[pairing.image1], images[pairing.image2], pairing.GetSimilarity(), pairing.image1, pairing.image2);
+            if(buffer.size() >= outputBufferLength){
+                matchWriter.Submit(buffer);
+            }
+        }
+        matchWriter.Submit(buffer);
+        if(!matchWriter.Close()){
+            cout << "Unable to write all matches to " << outputFileName << ".\n";
+            return 3;
+        }
+        cout << "Matches written to " << outputFileName << ".\n";
+        if(batchAction == batchActionNone){
+            return 0;
         }
     }
     
+    OfferMatches(images, matches);
     return 0;
 }
 
@@ -184,17 +1524,24 @@ string GetTitle(Image img, bool isFirst, double similarity, int id){
     return "[" + to_string(id+1) + "/" + to_string(matchesFound) + "," + withinPairIdentifier + "]{" + to_string(similarity) + "%}(" + to_string(img.width) + "x" + to_string(img.height) + ") " + img.fileName + "";
 }
 
-void ShowMatches(vector<Pairing> matches){
-    int currentMatch = 0;
+//Deleting an image blanks its file name in the table, so every pair it appears in shows the placeholder afterwards
+void ShowMatches(vector<Image>& images, const vector<Pairing>& matches, int firstMatch){
+    int currentMatch = firstMatch;
     int originalMatch = 0;//used to detect a change
     Pairing match = matches[currentMatch];
     matchesFound = matches.size();//used to form titles
     cout << "Showing " << matches.size() << " matches.\n";
 
-    CImg<unsigned char> image1CImg(match.image1.fileName.c_str());
-    CImg<unsigned char> image2CImg(match.image2.fileName.c_str());
-    CImg<unsigned char>* activeImage = &image1CImg;
-    CImgDisplay image_display(*activeImage, GetTitle(match.image1, true, match.similarity, currentMatch).c_str());
+    //Images are decoded no larger than the screen; Z swaps the shown image for its full resolution
+    int screenWidth = CImgDisplay::screen_width();
+    int screenHeight = CImgDisplay::screen_height();
+    ImagePrefetcher prefetcher([screenWidth, screenHeight](const Image& image, CImg<unsigned char>& cimg){ LoadForViewing(image, cimg, screenWidth, screenHeight); },
+        viewerCacheBytes, viewerPrefetchThreads);
+    PrefetchAround(prefetcher, images, matches, currentMatch);
+    shared_ptr<CImg<unsigned char>> image1CImg = prefetcher.Get(images[match.image1]);
+    shared_ptr<CImg<unsigned char>> image2CImg = prefetcher.Get(images[match.image2]);
+    shared_ptr<CImg<unsigned char>>* activeImage = &image1CImg;
+    CImgDisplay image_display(**activeImage, GetTitle(images[match.image1], true, match.GetSimilarity(), currentMatch).c_str());
     
     while(!image_display.is_closed()){
         
@@ -205,15 +1552,9 @@ void ShowMatches(vector<Pairing> matches){
         }
         
         if(image_display.is_keyD()){//delete current image
-            string targetDeletePath = match.image1.fileName;
-            
-            if(activeImage == &image2CImg){
-                targetDeletePath = match.image2.fileName;
-                match.image2.fileName = "";
-            }
-            else{
-                match.image1.fileName = "";
-            }
+            Image& target = images[activeImage == &image2CImg ? match.image2 : match.image1];
+            string targetDeletePath = target.fileName;
+            target.fileName = "";
             
             if(remove(targetDeletePath.c_str()) != 0){
                 cout << "Error deleting " << targetDeletePath << "\n";
@@ -221,9 +1562,9 @@ void ShowMatches(vector<Pairing> matches){
             else{
                 cout << "Deleted " << targetDeletePath << "\n";
                 image_display.set_title(("Deleted " + targetDeletePath).c_str());
-                CImg<unsigned char> temp(32,32,1,3,0);
-                *activeImage = temp;
-                image_display.display(*activeImage);
+                prefetcher.Forget(targetDeletePath);
+                *activeImage = make_shared<CImg<unsigned char>>(32,32,1,3,0);
+                Redraw(image_display, **activeImage);
             }
         }
         
@@ -243,56 +1584,301 @@ void ShowMatches(vector<Pairing> matches){
             currentMatch = min(currentMatch + 1, (int)matches.size() - 1);
         }
         
+        if(image_display.is_keyZ()){
+            const Image& shown = images[activeImage == &image1CImg ? match.image1 : match.image2];
+            if(shown.fileName.size() > 0 && (*activeImage)->width() < shown.width){
+                shared_ptr<CImg<unsigned char>> fullImage = make_shared<CImg<unsigned char>>();
+                try{
+                    LoadForViewing(shown, *fullImage, 0, 0);
+                    *activeImage = fullImage;
+                    Redraw(image_display, **activeImage);
+                }
+                catch(exception& e){
+                    cout << "Unable to load " << shown.fileName << " at full resolution\n";
+                }
+            }
+        }
+        
         if(image_display.is_keyF()){
             if(image_display.is_fullscreen()){
-                image_display.set_fullscreen(false, true);
+                SetFullscreen(image_display, false);
             }
             else{
-                image_display.set_fullscreen(true, true);
+                SetFullscreen(image_display, true);
             }
             
         }
     
         if(image_display.is_keyARROWLEFT()){
             activeImage = &image1CImg;
-            image_display.display(*activeImage);
-            image_display.set_title(GetTitle(match.image1, true, match.similarity, currentMatch).c_str());
+            Redraw(image_display, **activeImage);
+            image_display.set_title(GetTitle(images[match.image1], true, match.GetSimilarity(), currentMatch).c_str());
         }
         
         if(image_display.is_keyARROWRIGHT()){
             activeImage = &image2CImg;
-            image_display.display(*activeImage);
-            image_display.set_title(GetTitle(match.image2, false, match.similarity, currentMatch).c_str());
+            Redraw(image_display, **activeImage);
+            image_display.set_title(GetTitle(images[match.image2], false, match.GetSimilarity(), currentMatch).c_str());
         }
     
         //go to next matching pair
         if(originalMatch != currentMatch){
             match = matches[currentMatch];
- 
-            try{
-                image1CImg.assign(match.image1.fileName.c_str());
-            }
-            catch(exception& e){
-                image1CImg.assign(32,32,1,3,0);
-                //title = "Deleted (" + match.image1.fileName + ")";
-            }
             
-            try{
-                image2CImg.assign(match.image2.fileName.c_str());
-            }
-            catch(exception& e){
-                image2CImg.assign(32,32,1,3,0);
-                //title = "Deleted (" + match.image2.fileName + ")";
-            }
+            //unreadable (e.g. deleted) images come back as a black placeholder
+            PrefetchAround(prefetcher, images, matches, currentMatch);
+            image1CImg = prefetcher.Get(images[match.image1]);
+            image2CImg = prefetcher.Get(images[match.image2]);
             
             activeImage = &image1CImg;
-            image_display.display(*activeImage);
-            image_display.set_title(GetTitle(match.image1, true, match.similarity, currentMatch).c_str());
+            Redraw(image_display, **activeImage);
+            image_display.set_title(GetTitle(images[match.image1], true, match.GetSimilarity(), currentMatch).c_str());
         }
     
         CImgDisplay::wait(image_display);
     }
+    ReportRedrawTimes();
+}
+
+//Contact sheet of matches: a screenful of pairs per page, drawn from the thumbnails kept with the profiles.  Arrow
+//keys or a click select a pair, Page Up/Down flip pages, and Enter opens the selected pair in ShowMatches.  Images
+//without a kept thumbnail are shown as placeholders while worker threads make one from the original.
+void ShowMatchGrid(vector<Image>& images, const vector<Pairing>& matches){
+    const int tileWidth = gridThumbnailLength * 2 + 16;
+    const int tileHeight = gridThumbnailLength + 24;
+    int columns = max(1, (CImgDisplay::screen_width() - 32) / tileWidth);
+    int rows = max(1, (CImgDisplay::screen_height() - 96) / tileHeight);
+    int pageSize = columns * rows;
+    int pageCount = (matches.size() + pageSize - 1) / pageSize;
+    cout << "Showing " << matches.size() << " matches on " << pageCount << " page(s).\n";
+    
+    ImagePrefetcher prefetcher([](const Image& image, CImg<unsigned char>& cimg){ LoadForViewing(image, cimg, gridThumbnailLength, gridThumbnailLength); },
+        viewerCacheBytes, viewerPrefetchThreads);
+    int selected = 0;
+    CImg<unsigned char> canvas(columns * tileWidth, rows * tileHeight, 1, 3, 0);
+    int pendingCount = RenderGridPage(canvas, images, matches, 0, columns, rows, selected, prefetcher);
+    CImgDisplay grid_display(canvas, "");
+    int shownSelection = -1;
+    while(!grid_display.is_closed()){
+        int previousSelection = selected;
+        if(grid_display.is_keyESC()){
+            grid_display.close();
+            break;
+        }
+        if(grid_display.is_keyARROWRIGHT()){
+            selected = min(selected + 1, (int)matches.size() - 1);
+        }
+        if(grid_display.is_keyARROWLEFT()){
+            selected = max(selected - 1, 0);
+        }
+        if(grid_display.is_keyARROWDOWN()){
+            selected = min(selected + columns, (int)matches.size() - 1);
+        }
+        if(grid_display.is_keyARROWUP()){
+            selected = max(selected - columns, 0);
+        }
+        if(grid_display.is_keyPAGEDOWN()){
+            selected = min(selected + pageSize, (int)matches.size() - 1);
+        }
+        if(grid_display.is_keyPAGEUP()){
+            selected = max(selected - pageSize, 0);
+        }
+        if(grid_display.is_keyHOME()){
+            selected = 0;
+        }
+        if(grid_display.is_keyEND()){
+            selected = matches.size() - 1;
+        }
+        if(grid_display.button() & 1 && grid_display.mouse_x() >= 0 && grid_display.mouse_y() >= 0){
+            int clicked = (selected / pageSize) * pageSize + (grid_display.mouse_y() / tileHeight) * columns + grid_display.mouse_x() / tileWidth;
+            if(clicked < (int)matches.size()){
+                selected = clicked;
+            }
+            grid_display.set_button();
+        }
+        if(grid_display.is_keyENTER()){
+            grid_display.set_key();
+            ShowMatches(images, matches, selected);//only the selected pair's originals are loaded
+        }
         
+        //the page is composed off screen and shown with a single blit, and again as placeholders are filled in
+        if(selected != previousSelection || shownSelection < 0 || pendingCount > 0){
+            pendingCount = RenderGridPage(canvas, images, matches, (selected / pageSize) * pageSize, columns, rows, selected, prefetcher);
+            Redraw(grid_display, canvas);
+            grid_display.set_title("[%d/%d] page %d/%d  %s", selected + 1, (int)matches.size(), selected / pageSize + 1, pageCount, images[matches[selected].image1].fileName.c_str());
+            shownSelection = selected;
+        }
+        if(pendingCount > 0){
+            grid_display.wait(50);
+        }
+        else{
+            CImgDisplay::wait(grid_display);
+        }
+    }
+    ReportRedrawTimes();
+}
+
+//Redraws go through XShmPutImage when the binary is built with cimg_use_xshm and the X server shares memory with
+//us; CImg falls back to XPutImage over the socket otherwise (remote displays, no MIT-SHM).  With isTimingRedraws,
+//each redraw is synced so its time covers the server finishing the copy.
+void Redraw(CImgDisplay& display, const CImg<unsigned char>& image){
+    if(!isTimingRedraws){
+        display.display(image);
+        return;
+    }
+    chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+    display.display(image);
+#if cimg_display == 1
+    XSync(cimg::X11_attr().display, False);
+#endif
+    redrawMilliseconds.push_back(chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - start).count() / 1000.0);
+}
+
+void SetFullscreen(CImgDisplay& display, bool isFullscreen){
+    if(!isTimingRedraws){
+        display.set_fullscreen(isFullscreen, true);
+        return;
+    }
+    chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+    display.set_fullscreen(isFullscreen, true);
+#if cimg_display == 1
+    XSync(cimg::X11_attr().display, False);
+#endif
+    redrawMilliseconds.push_back(chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - start).count() / 1000.0);
+}
+
+void ReportRedrawTimes(){
+    if(isTimingRedraws && redrawMilliseconds.size() > 0){
+        sort(redrawMilliseconds.begin(), redrawMilliseconds.end());
+        double total = accumulate(redrawMilliseconds.begin(), redrawMilliseconds.end(), 0.0);
+        bool usesSharedMemory = false;
+#if cimg_display == 1 && defined(cimg_use_xshm)
+        usesSharedMemory = cimg::X11_attr().is_shm_enabled;
+#endif
+        cout << redrawMilliseconds.size() << " redraw(s) " << (usesSharedMemory ? "through MIT-SHM" : "over the X socket") << ": mean " << total / redrawMilliseconds.size()
+            << " ms, median " << redrawMilliseconds[redrawMilliseconds.size() / 2] << " ms, max " << redrawMilliseconds.back() << " ms.\n";
+    }
+    redrawMilliseconds.clear();
+}
+
+//Returns how many thumbnails on the page are still placeholders
+int RenderGridPage(CImg<unsigned char>& canvas, const vector<Image>& images, const vector<Pairing>& matches, int firstMatch, int columns, int rows, int selected, ImagePrefetcher& prefetcher){
+    const unsigned char background[] = {32, 32, 32};
+    const unsigned char placeholder[] = {64, 64, 64};
+    const unsigned char highlight[] = {255, 200, 0};
+    const unsigned char white[] = {255, 255, 255};
+    const int tileWidth = canvas.width() / columns;
+    const int tileHeight = canvas.height() / rows;
+    canvas.fill(background[0]);
+    vector<Image> missing;
+    for(int tile = 0; tile < columns * rows && firstMatch + tile < (int)matches.size(); tile++){
+        const Pairing& match = matches[firstMatch + tile];
+        int left = (tile % columns) * tileWidth + 4;
+        int top = (tile / columns) * tileHeight + 4;
+        const Image* pair[] = {&images[match.image1], &images[match.image2]};
+        for(int side = 0; side < 2; side++){
+            const CImg<unsigned char>* thumbnail = GetGridThumbnail(*pair[side]);
+            shared_ptr<CImg<unsigned char>> made = thumbnail == NULL ? prefetcher.Find(pair[side]->fileName) : NULL;
+            if(made != NULL){
+                thumbnail = made.get();
+            }
+            if(thumbnail == NULL){
+                float scale = min(1.0f, (float)gridThumbnailLength / max(1, max(pair[side]->width, pair[side]->height)));
+                int width = max(1, (int)(pair[side]->width * scale));
+                int height = max(1, (int)(pair[side]->height * scale));
+                int x = left + side * (gridThumbnailLength + 4) + (gridThumbnailLength - width) / 2;
+                int y = top + (gridThumbnailLength - height) / 2;
+                canvas.draw_rectangle(x, y, x + width - 1, y + height - 1, placeholder);
+                missing.push_back(*pair[side]);
+                continue;
+            }
+            int x = left + side * (gridThumbnailLength + 4) + (gridThumbnailLength - thumbnail->width()) / 2;
+            int y = top + (gridThumbnailLength - thumbnail->height()) / 2;
+            canvas.draw_image(x, y, *thumbnail);
+        }
+        canvas.draw_text(left, top + gridThumbnailLength + 2, "%d  %.1f%%", white, 0, 1, 13, firstMatch + tile + 1, match.GetSimilarity());
+        if(firstMatch + tile == selected){
+            canvas.draw_rectangle(left - 3, top - 3, left + tileWidth - 6, top + tileHeight - 6, highlight, 1, ~0U);
+            canvas.draw_rectangle(left - 2, top - 2, left + tileWidth - 7, top + tileHeight - 7, highlight, 1, ~0U);
+        }
+    }
+    if(missing.size() > 0){
+        prefetcher.Prefetch(missing);
+    }
+    return missing.size();
+}
+
+//The image's kept thumbnail, decoded once; NULL when none was kept and it has to be made from the original
+const CImg<unsigned char>* GetGridThumbnail(const Image& image){
+    map<string, CImg<unsigned char>>::iterator decoded = gridThumbnails.find(image.fileName);
+    if(decoded != gridThumbnails.end()){
+        return &decoded->second;
+    }
+    CImg<unsigned char> thumbnail;
+    if(image.thumbnail.empty() || !DecodeImageBuffer((const unsigned char*)image.thumbnail.data(), image.thumbnail.size(), thumbnail, 0)){
+        return NULL;
+    }
+    return &(gridThumbnails[image.fileName] = thumbnail);
+}
+
+//Thumbnails are kept for the grid, and for the profile attributes and band file that later grid sessions read them from
+bool KeepsGridThumbnails(){
+    return usesMatchGrid || usesProfileAttributes || bandFileName.size() > 0;
+}
+
+void StoreGridThumbnail(Image& image, const CImg<unsigned char>& cimg){
+#ifdef cimg_use_jpeg
+    float scale = min(1.0f, (float)gridThumbnailLength / max(cimg.width(), cimg.height()));
+    CImg<unsigned char> thumbnail = scale < 1 ? BoxDownsample(cimg, max(1, (int)(cimg.width() * scale)), max(1, (int)(cimg.height() * scale))) : cimg;
+    if(!EncodeJpeg(thumbnail, gridThumbnailQuality, image.thumbnail)){
+        image.thumbnail.clear();
+    }
+#endif
+}
+
+//Queues the shown pair, then the pairs viewerPrefetchPairs either side of it, nearest first
+void PrefetchAround(ImagePrefetcher& prefetcher, const vector<Image>& images, const vector<Pairing>& matches, int currentMatch){
+    vector<Image> wanted = {images[matches[currentMatch].image1], images[matches[currentMatch].image2]};
+    for(int distance = 1; distance <= viewerPrefetchPairs; distance++){
+        for(int index : {currentMatch + distance, currentMatch - distance}){
+            if(index >= 0 && index < (int)matches.size()){
+                wanted.push_back(images[matches[index].image1]);
+                wanted.push_back(images[matches[index].image2]);
+            }
+        }
+    }
+    prefetcher.Prefetch(wanted);
+}
+
+//Loads an image to fit within maximumWidth x maximumHeight (0 for full resolution).  JPEGs, and the embedded
+//previews RAW files are shown through, are decoded at the smallest DCT scale that still covers that size; anything
+//left oversized is box filtered down.
+void LoadForViewing(const Image& image, CImg<unsigned char>& cimg, int maximumWidth, int maximumHeight){
+    float scale = 1;
+    if(maximumWidth > 0 && maximumHeight > 0 && image.width > 0 && image.height > 0){
+        scale = min(1.0f, min((float)maximumWidth / image.width, (float)maximumHeight / image.height));
+    }
+    int minimumLength = scale < 1 ? (int)ceil(min(image.width, image.height) * scale) : 0;
+    
+    vector<unsigned char> data;
+    if(image.previewLength > 0){
+        if(!ReadPreview(image, data) || !DecodeImageBuffer(data.data(), data.size(), cimg, minimumLength)){
+            throw CImgIOException("Unable to decode the embedded preview of %s", image.fileName.c_str());
+        }
+    }
+    else{
+        ifstream file(image.fileName.c_str(), ios::binary);
+        data.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+        if(data.size() == 0 || !DecodeImageBuffer(data.data(), data.size(), cimg, minimumLength)){
+            cimg.assign(image.fileName.c_str());
+        }
+    }
+    
+    int fittedWidth = max(1, (int)round(image.width * scale));
+    int fittedHeight = max(1, (int)round(image.height * scale));
+    if(scale < 1 && cimg.width() > fittedWidth && cimg.height() > fittedHeight){
+        cimg = BoxDownsample(cimg, fittedWidth, fittedHeight);
+    }
 }
 
 vector<float> ConvertToYUV(vector<int> colour){
@@ -305,6 +1891,24 @@ vector<float> ConvertToYUV(vector<int> colour){
     return vector<float> {y, u, v};
 }
 
+//Peak memory of decoding and profiling an image: its RGB bitmap, which CreateProfile reads in place
+long long EstimateDecodeBytes(const Image& image){
+    return (long long)image.width * image.height * 3;
+}
+
+float GetAspectRatio(const Image& image){
+    return (float)image.width / (float)image.height;
+}
+
+//Largest aspect ratio difference whose penalty still allows a similarity above minimumSimilarity (or the band floor)
+float GetMaximumAspectRatioDifference(){
+    if(!usesAspectRatioPenalty || aspectRatioPenalty <= 0){
+        return numeric_limits<float>::infinity();
+    }
+    int lowestSimilarity = bandFileName.size() > 0 ? min(minimumSimilarity, bandFloor) : minimumSimilarity;
+    return (1.0f - lowestSimilarity / 100.0f) / aspectRatioPenalty + 0.0001f;
+}
+
 float GetAspectRatioPenalty(Image image1, Image image2){
     float image1ar = (float)image1.width / (float)image1.height;
     float image2ar = (float)image2.width / (float)image2.height;
@@ -314,6 +1918,17 @@ float GetAspectRatioPenalty(Image image1, Image image2){
     return multiplier;
 }
 
+float GetSimilarity(const Image& image1, const Image& image2){
+    float similarity = CompareProfiles(image1.smallProfile, image2.smallProfile);
+    
+    if(usesAspectRatioPenalty){
+        float penaltyMultiplier = GetAspectRatioPenalty(image1, image2);
+        similarity *= penaltyMultiplier;
+    }
+    
+    return similarity;
+}
+
 float CompareProfiles(vector<vector<int>> image1, vector<vector<int>> image2){
     float similarSums = 0;
     for(int i = 0; i < image1.size(); i++){
@@ -337,124 +1952,2663 @@ float GetYUVColourSimilarity(vector<float> a, vector<float> b){
     return similarity;
 }
 
-vector<vector<int>> CreateProfile(CImg<unsigned char> image, int resolution){
-    vector<vector<int>> profile;
+vector<vector<int>> CreateProfile(const CImg<unsigned char>& image, int resolution){
     //TODO hook width and height to resolution? create multiple profiles then
     int width = 16, height = 16;
     
-    CImg<unsigned char> thumb = image.resize(width, height);
+    if(usesAreaAverageProfile){
+        return CreateAreaAverageProfile(image, width, height);
+    }
+    return CreateNearestProfile(image, width, height);
+}
+
+//Samples the grid straight out of the borrowed image, picking the same pixels CImg's nearest-neighbour
+//resize(width, height) would without allocating a resized copy
+vector<vector<int>> CreateNearestProfile(const CImg<unsigned char>& image, int width, int height){
+    vector<vector<int>> profile;
+    int lastChannel = image.spectrum() - 1;//grayscale images repeat their one channel
+    for(int x = 0; x < width; x++){
+        int sourceX = (int)((double)x * image.width() / width);
+        for(int y = 0; y < height; y++){
+            int sourceY = (int)((double)y * image.height() / height);
+            vector<int> temp = {image(sourceX, sourceY, 0, 0), image(sourceX, sourceY, 0, min(1, lastChannel)), image(sourceX, sourceY, 0, min(2, lastChannel))};
+            profile.push_back(temp);
+        }
+    }
+    return profile;
+}
+
+//Box filter: every grid cell is the rounded mean of all the source pixels it covers.  Source rows are streamed once,
+//top to bottom, and each row's span under a cell is summed with SumBytes.  Images smaller than the grid fall back
+//to the nearest pixel for cells that cover none.
+vector<vector<int>> CreateAreaAverageProfile(const CImg<unsigned char>& image, int width, int height){
+    vector<int> columnStarts(width + 1);
+    vector<int> rowStarts(height + 1);
+    for(int x = 0; x <= width; x++){
+        columnStarts[x] = (int)((double)x * image.width() / width);
+    }
+    for(int y = 0; y <= height; y++){
+        rowStarts[y] = (int)((double)y * image.height() / height);
+    }
     
-    /*
-    CImg<unsigned char> activeImage = thumb;
-    CImgDisplay image_display(activeImage, "");
-    while(!image_display.is_closed()){
-        CImgDisplay::wait(image_display);
+    int channelCount = min(3, image.spectrum());
+    vector<unsigned long long> sums(width * height * 3, 0);
+    for(int cellY = 0; cellY < height; cellY++){
+        int rowEnd = max(rowStarts[cellY] + 1, rowStarts[cellY + 1]);
+        for(int y = rowStarts[cellY]; y < rowEnd; y++){
+            for(int c = 0; c < channelCount; c++){
+                const unsigned char* row = image.data(0, y, 0, c);
+                for(int cellX = 0; cellX < width; cellX++){
+                    int columnEnd = max(columnStarts[cellX] + 1, columnStarts[cellX + 1]);
+                    sums[(cellX * height + cellY) * 3 + c] += SumBytes(row + columnStarts[cellX], columnEnd - columnStarts[cellX]);
+                }
+            }
+        }
     }
-    */
     
+    vector<vector<int>> profile;
     for(int x = 0; x < width; x++){
+        unsigned long long columnCount = max(columnStarts[x] + 1, columnStarts[x + 1]) - columnStarts[x];
         for(int y = 0; y < height; y++){
-
-            vector<int> temp = {thumb(x, y, 0, 0), thumb(x, y, 0, 1), thumb(x, y, 0, 2)};
+            unsigned long long count = columnCount * (max(rowStarts[y] + 1, rowStarts[y + 1]) - rowStarts[y]);
+            const unsigned long long* cell = &sums[(x * height + y) * 3];
+            vector<int> temp(3);
+            for(int c = 0; c < 3; c++){
+                temp[c] = (cell[min(c, channelCount - 1)] + count / 2) / count;//grayscale images repeat their one channel
+            }
             profile.push_back(temp);
         }
     }
-
     return profile;
 }
 
-long long factorial(int x){
-    if(x <= 0){
-        return 0;
+//The same box filter at display sizes, one output row at a time
+CImg<unsigned char> BoxDownsample(const CImg<unsigned char>& image, int width, int height){
+    vector<int> columnStarts(width + 1);
+    for(int x = 0; x <= width; x++){
+        columnStarts[x] = (int)((double)x * image.width() / width);
     }
-
-    long long result = x;
     
-    while(x > 1){
-        x--;
-        result *= x;
+    CImg<unsigned char> result(width, height, 1, image.spectrum());
+    vector<unsigned long long> sums(width);
+    for(int c = 0; c < image.spectrum(); c++){
+        for(int cellY = 0; cellY < height; cellY++){
+            int rowStart = (int)((double)cellY * image.height() / height);
+            int rowEnd = max(rowStart + 1, (int)((double)(cellY + 1) * image.height() / height));
+            fill(sums.begin(), sums.end(), 0);
+            for(int y = rowStart; y < rowEnd; y++){
+                const unsigned char* row = image.data(0, y, 0, c);
+                for(int cellX = 0; cellX < width; cellX++){
+                    int columnEnd = max(columnStarts[cellX] + 1, columnStarts[cellX + 1]);
+                    sums[cellX] += SumBytes(row + columnStarts[cellX], columnEnd - columnStarts[cellX]);
+                }
+            }
+            unsigned char* output = result.data(0, cellY, 0, c);
+            for(int cellX = 0; cellX < width; cellX++){
+                unsigned long long count = (unsigned long long)(max(columnStarts[cellX] + 1, columnStarts[cellX + 1]) - columnStarts[cellX]) * (rowEnd - rowStart);
+                output[cellX] = (sums[cellX] + count / 2) / count;
+            }
+        }
     }
-
     return result;
 }
 
-vector<string> GetImageList(string path, bool isRecursive){
-    vector<string> files;
-    vector<string> directories;
+unsigned long long SumBytesScalar(const unsigned char* data, size_t length){
+    unsigned long long sum = 0;
+    for(size_t i = 0; i < length; i++){
+        sum += data[i];
+    }
+    return sum;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//32 bytes per step: vpsadbw against zero leaves four 64-bit partial sums per register
+__attribute__((target("avx2")))
+unsigned long long SumBytesAvx2(const unsigned char* data, size_t length){
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i total = zero;
+    size_t i = 0;
+    for(; i + 32 <= length; i += 32){
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i*)(data + i)), zero));
+    }
+    unsigned long long lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, total);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + SumBytesScalar(data + i, length - i);
+}
+#endif
+
+//Probes the headers of files, then decodes and profiles every image that passes.  When skipsUnmatchable is set,
+//images whose aspect ratio leaves them no possible partner are not decoded unless listed in alwaysDecoded.
+//The returned images are in aspect ratio order.
+vector<Image> ProfileFiles(const vector<string>& files, vector<string>& ignoredImages, const set<string>& alwaysDecoded, bool skipsUnmatchable){
+    vector<Image> probedImages(files.size());
+    vector<ProfileStatus> probeResults(files.size(), profileFailed);
     
-    directories.push_back(path);
-    int maxLoops = 1000;
-    int currentLoop = 0;
-    while(directories.size() > 0){
-        path = directories[directories.size() - 1];
-        directories.pop_back();
-        
-        vector<string> foundImages = GetImagesInDirectory(path, (currentLoop == 0 ? true : false));
-        files.insert(files.end(), foundImages.begin(), foundImages.end());
-        
-        if(isRecursive){
-            vector<string> foundDirectories = GetDirectoriesInDirectory(path, (currentLoop == 0 ? true : false));
-            directories.insert(directories.end(), foundDirectories.begin(), foundDirectories.end());
+    //Files carrying an up to date profile attribute need neither a probe nor a decode
+    vector<size_t> probeIndices;
+    vector<string> probeFiles;
+    for(size_t i = 0; i < files.size(); i++){
+        if(usesProfileAttributes && LoadStoredProfile(files[i], probedImages[i])){
+            probeResults[i] = profileCreated;
+            continue;
         }
-        
-        currentLoop++;
-        if(currentLoop > maxLoops){
-            break;
+        probeIndices.push_back(i);
+        probeFiles.push_back(files[i]);
+    }
+    if(usesProfileAttributes){
+        cout << files.size() - probeFiles.size() << " profile(s) read from extended attributes.\n";
+    }
+    
+    //Read dimensions from the headers first so undersized and unreadable files are never decoded
+    int thumbnailCount = 0;
+    int cachedThumbnailCount = 0;
+    int unsignedCount = 0;
+    ReadFiles(probeFiles, probeReadLength, [&](size_t probeIndex, const unsigned char* data, size_t length){
+        size_t index = probeIndices[probeIndex];
+        if(isSniffing && data != NULL && GetSignatureType(data, length) == imageTypeNone){
+            unsignedCount++;
+            return;
         }
-        
+        probeResults[index] = ProbeImage(files[index], probedImages[index], data, length);
+        if(probeResults[index] != profileCreated){
+            return;
+        }
+        if(usesThumbnailCache && ProfileFromThumbnailCache(probedImages[index])){
+            cachedThumbnailCount++;
+        }
+        else if(usesThumbnailProfile && ProfileFromExifThumbnail(probedImages[index], data, length)){
+            thumbnailCount++;
+        }
+    }, NULL, vector<long long>());
+    if(isSniffing){
+        cout << unsignedCount << " file(s) dropped for not starting with a JPEG, PNG or TIFF signature.\n";
+    }
+    if(usesThumbnailCache){
+        cout << cachedThumbnailCount << " image(s) profiled from the thumbnail cache.\n";
+    }
+    if(usesThumbnailProfile){
+        cout << thumbnailCount << " image(s) profiled from their embedded EXIF thumbnail.\n";
     }
     
-    return files;
-}
-
-vector<string> GetImagesInDirectory(const string& path, bool isFirstLevel){
-    vector<string> imageList;
-    DIR *dirPointer;
-    struct dirent *entry;
-    dirPointer = opendir(path.c_str());
-    if(dirPointer != NULL){
-        while ((entry = readdir(dirPointer)) != NULL){
-            string entryName = entry->d_name;
-            if(entry->d_type != DT_DIR && ((entryName.find(".jpg") != string::npos) || entryName.find(".png") != string::npos)){
-                //TODO: verify it's at the end of the string before adding to list
-                //TODO possibly check first few bytes to verify it's an image? time cost related to doing this?
-                if(isFirstLevel){
-                    imageList.push_back(path + entry->d_name);
-                }
-                else{
-                    imageList.push_back(path + "/" + entry->d_name);
-                }
-            }        
+    vector<Image> candidates;
+    for(size_t i = 0; i < files.size(); i++){
+        if(probeResults[i] == profileCreated){
+            candidates.push_back(probedImages[i]);
+        }
+        else if(probeResults[i] == profileTooSmall){
+            ignoredImages.push_back(files[i]);
+        }
+    }
+    
+    //Sorted by aspect ratio, an image whose neighbours are all too far off can't pass minimumSimilarity and needn't be decoded
+    float maximumAspectRatioDifference = GetMaximumAspectRatioDifference();
+    stable_sort(candidates.begin(), candidates.end(), [](const Image& a, const Image& b){ return GetAspectRatio(a) < GetAspectRatio(b); });
+    
+    vector<Image> decodeQueue;
+    vector<string> decodeFiles;
+    int unmatchableCount = 0;
+    for(size_t i = 0; i < candidates.size(); i++){
+        bool hasNeighbour = (i > 0 && GetAspectRatio(candidates[i]) - GetAspectRatio(candidates[i - 1]) <= maximumAspectRatioDifference)
+            || (i + 1 < candidates.size() && GetAspectRatio(candidates[i + 1]) - GetAspectRatio(candidates[i]) <= maximumAspectRatioDifference);
+        if(!hasNeighbour && skipsUnmatchable && alwaysDecoded.count(candidates[i].fileName) == 0){
+            unmatchableCount++;
+            continue;
+        }
+        decodeQueue.push_back(candidates[i]);
+        decodeFiles.push_back(candidates[i].fileName);
+    }
+    
+    if(unmatchableCount > 0){
+        cout << unmatchableCount << " image(s) were not decoded since no other image has a close enough aspect ratio.\n";
+    }
+    
+    //Create smallProfiles for all images.  The queue is dealt out largest first to decodeThreadCount threads, each with
+    //its own I/O stage, and every decode waits for room in the shared memory budget before it starts.
+    vector<size_t> decodeOrder;
+    vector<ProfileStatus> decodeResults(decodeQueue.size(), profileFailed);
+    for(size_t i = 0; i < decodeQueue.size(); i++){
+        if(decodeQueue[i].smallProfile.empty()){
+            decodeOrder.push_back(i);
+        }
+        else{
+            decodeResults[i] = profileCreated;//already profiled from a thumbnail or a stored profile
+        }
+    }
+    stable_sort(decodeOrder.begin(), decodeOrder.end(), [&decodeQueue](size_t a, size_t b){ return EstimateDecodeBytes(decodeQueue[a]) > EstimateDecodeBytes(decodeQueue[b]); });
+    
+    //A file is charged to the budget, with its decoded size, before it is read, and released once it is decoded
+    MemoryBudget budget(decodeMemoryBudget);
+    size_t threadCount = max((size_t)1, min((size_t)decodeThreadCount, decodeOrder.size()));
+    auto decodeShare = [&](size_t share){
+        vector<size_t> shareIndices;
+        vector<string> shareFiles;
+        vector<long long> shareDecodeBytes;
+        vector<size_t> previewIndices;
+        for(size_t i = share; i < decodeOrder.size(); i += threadCount){
+            if(decodeQueue[decodeOrder[i]].previewLength > 0){
+                previewIndices.push_back(decodeOrder[i]);
+                continue;
+            }
+            shareIndices.push_back(decodeOrder[i]);
+            shareFiles.push_back(decodeFiles[decodeOrder[i]]);
+            shareDecodeBytes.push_back(EstimateDecodeBytes(decodeQueue[decodeOrder[i]]));
+        }
+        ReadFiles(shareFiles, 0, [&](size_t index, const unsigned char* data, size_t length){
+            Image& image = decodeQueue[shareIndices[index]];
+            decodeResults[shareIndices[index]] = DecodeImageProfile(image, data, length);
+            if(usesProfileAttributes && decodeResults[shareIndices[index]] == profileCreated){
+                StoreProfile(image);
+            }
+        }, &budget, shareDecodeBytes);
+        
+        //RAW files only need their embedded preview, which is read on its own rather than with the rest of the file
+        for(size_t index : previewIndices){
+            Image& image = decodeQueue[index];
+            long long charge = image.previewLength + EstimateDecodeBytes(image);
+            budget.Acquire(charge);
+            vector<unsigned char> preview;
+            if(!ReadPreview(image, preview)){
+                budget.Release(charge);
+                cout << image.fileName << " has an unreadable embedded preview.  Skipping...\n";
+                continue;
+            }
+            decodeResults[index] = DecodeImageProfile(image, preview.data(), preview.size());
+            vector<unsigned char>().swap(preview);
+            budget.Release(charge);
+            if(usesProfileAttributes && decodeResults[index] == profileCreated){
+                StoreProfile(image);
+            }
+        }
+    };
+    
+    vector<thread> threads;
+    for(size_t share = 1; share < threadCount; share++){
+        threads.push_back(thread(decodeShare, share));
+    }
+    decodeShare(0);
+    for(thread& worker : threads){
+        worker.join();
+    }
+    
+    vector<Image> images;
+    for(size_t i = 0; i < decodeQueue.size(); i++){
+        if(decodeResults[i] == profileCreated){
+            if(!usesMatchGrid && bandFileName.size() == 0){
+                decodeQueue[i].thumbnail.clear();//only made for the profile attribute, which has it by now
+            }
+            images.push_back(decodeQueue[i]);
+        }
+        else if(decodeResults[i] == profileTooSmall){
+            ignoredImages.push_back(decodeQueue[i].fileName);
+        }
+    }
+    return images;
+}
+
+//Fills in fileName, width and height from the file header without decoding any pixels.  head holds the start of
+//the file when the I/O stage has already read it.
+ProfileStatus ProbeImage(const string& fileName, Image& image, const unsigned char* head, size_t headLength){
+    image.fileName = fileName;
+    struct stat fileInfo;
+    if(stat(fileName.c_str(), &fileInfo) == 0){
+        RecordFileState(image, fileInfo);
+    }
+    if(!ReadImageDimensions(fileName, image, head, headLength)){
+        cout << fileName << " does not have a readable JPEG or PNG header or embedded JPEG preview.  Skipping...\n";
+        return profileFailed;
+    }
+    if(image.width < imageMinimumLength || image.height < imageMinimumLength){
+        return profileTooSmall;
+    }
+    return profileCreated;
+}
+
+//Decodes from the file's contents in memory, or from disk through CImg when they aren't available or the
+//built-in decoders can't handle them
+ProfileStatus DecodeImageProfile(Image& image, const unsigned char* data, size_t length){
+    try{
+        //a DCT-scaled decode already averages blocks, so it only stands in for the full image under area averaging
+        int minimumLength = usesThumbnailProfile && usesAreaAverageProfile ? scaledDecodeMinimumLength : 0;
+        CImg<unsigned char> tempCImg;
+        if(data == NULL || !DecodeImageBuffer(data, length, tempCImg, minimumLength)){
+            if(image.previewLength > 0){//CImg can't do any better with a RAW file
+                cout << image.fileName + " has an embedded preview that could not be decoded.  Skipping...\n";
+                return profileFailed;
+            }
+            tempCImg.load(image.fileName.c_str());
+            minimumLength = 0;
+        }
+    
+        if(tempCImg.width() < imageMinimumLength || tempCImg.height() < imageMinimumLength){
+            return profileTooSmall;
+        }
+        
+        if(minimumLength == 0){//a scaled decode keeps the header's dimensions
+            image.height = tempCImg.height();
+            image.width = tempCImg.width();
+        }
+        image.smallProfile = CreateProfile(tempCImg, 1);
+        if(KeepsGridThumbnails()){
+            StoreGridThumbnail(image, tempCImg);
+        }
+        return profileCreated;
+    }
+    catch(CImgIOException e){
+        cout << image.fileName + " has caused an error.  It may not be a valid image file.  Skipping...\n";
+    }
+    catch(...){
+        cout << image.fileName + " has caused an error.  Skipping...\n";
+    }
+    return profileFailed;
+}
+
+//Reads width and height from a PNG IHDR chunk, a JPEG SOF marker, or the largest JPEG preview of a TIFF-based RAW file
+bool ParseImageDimensions(const ByteReader& read, long long fileLength, int& width, int& height, long long& previewOffset, long long& previewLength){
+    unsigned char header[24];
+    previewOffset = 0;
+    previewLength = 0;
+    if(!read(0, header, 2)){
+        return false;
+    }
+    
+    if(header[0] == 0x89 && header[1] == 'P'){
+        //signature(8) length(4) "IHDR"(4) width(4) height(4)
+        if(!read(0, header, 24) || memcmp(header, "\x89PNG\r\n\x1a\n", 8) != 0 || memcmp(header + 12, "IHDR", 4) != 0){
+            return false;
+        }
+        width = (header[16] << 24) | (header[17] << 16) | (header[18] << 8) | header[19];
+        height = (header[20] << 24) | (header[21] << 16) | (header[22] << 8) | header[23];
+        return width > 0 && height > 0;
+    }
+    
+    if((header[0] == 'I' && header[1] == 'I') || (header[0] == 'M' && header[1] == 'M')){
+        return FindRawPreview(read, fileLength, width, height, previewOffset, previewLength);
+    }
+    
+    int frameMarker;
+    return ParseJpegDimensions(read, width, height, frameMarker);
+}
+
+//Reads a JPEG's dimensions from its SOF marker, and which SOF it is.  Segments before the SOF (EXIF, ICC, ...) are
+//stepped over by their lengths, so only a few KB are looked at even when the metadata is large.
+bool ParseJpegDimensions(const ByteReader& read, int& width, int& height, int& frameMarker){
+    unsigned char header[8];
+    if(!read(0, header, 2)){
+        return false;
+    }
+    if(header[0] != 0xFF || header[1] != 0xD8){
+        return false;
+    }
+    long long position = 2;
+    while(true){
+        if(!read(position, header, 2) || header[0] != 0xFF){
+            return false;
+        }
+        int marker = header[1];
+        position += 2;
+        while(marker == 0xFF){//fill bytes
+            if(!read(position++, header, 1)){
+                return false;
+            }
+            marker = header[0];
+        }
+        if(marker == 0xD9 || marker == 0xDA){//no frame header before the image data
+            return false;
+        }
+        if(marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)){//standalone markers carry no length
+            continue;
+        }
+        if(!read(position, header, 2)){
+            return false;
+        }
+        int length = (header[0] << 8) | header[1];
+        if(length < 2){
+            return false;
+        }
+        bool isStartOfFrame = marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC;
+        if(isStartOfFrame){
+            //length(2) precision(1) height(2) width(2)
+            if(length < 7 || !read(position + 2, header, 5)){
+                return false;
+            }
+            height = (header[1] << 8) | header[2];
+            width = (header[3] << 8) | header[4];
+            frameMarker = marker;
+            return width > 0 && height > 0;
+        }
+        position += length;
+    }
+}
+
+//Walks the IFDs of a TIFF-based RAW file (CR2, NEF, ARW, DNG), including SubIFDs, for JPEG streams given either
+//as JPEGInterchangeFormat or as a single JPEG-compressed strip.  The largest one libjpeg can decode (baseline or
+//progressive, not the lossless JPEG some formats use for sensor data) is chosen as the preview.
+bool FindRawPreview(const ByteReader& read, long long fileLength, int& width, int& height, long long& previewOffset, long long& previewLength){
+    unsigned char header[8];
+    if(!read(0, header, 8)){
+        return false;
+    }
+    bool isLittleEndian = header[0] == 'I';
+    auto get16 = [isLittleEndian](const unsigned char* bytes){ return isLittleEndian ? bytes[0] | (bytes[1] << 8) : (bytes[0] << 8) | bytes[1]; };
+    auto get32 = [isLittleEndian](const unsigned char* bytes){
+        return isLittleEndian ? (long long)bytes[0] | ((long long)bytes[1] << 8) | ((long long)bytes[2] << 16) | ((long long)bytes[3] << 24)
+            : ((long long)bytes[0] << 24) | ((long long)bytes[1] << 16) | ((long long)bytes[2] << 8) | (long long)bytes[3];
+    };
+    if(get16(header + 2) != 42){
+        return false;
+    }
+    
+    vector<long long> pending = {get32(header + 4)};
+    set<long long> visited;
+    long long bestArea = 0;
+    while(pending.size() > 0 && visited.size() < 64){
+        long long ifd = pending.back();
+        pending.pop_back();
+        if(ifd <= 0 || !visited.insert(ifd).second || !read(ifd, header, 2)){
+            continue;
+        }
+        int entryCount = get16(header);
+        vector<unsigned char> entries(entryCount * 12 + 4);
+        if(entryCount == 0 || !read(ifd + 2, entries.data(), entries.size())){
+            continue;
+        }
+        
+        int compression = 0;
+        long long stripOffset = 0, stripLength = 0, jpegOffset = 0, jpegLength = 0;
+        for(int i = 0; i < entryCount; i++){
+            const unsigned char* entry = entries.data() + i * 12;
+            int tag = get16(entry);
+            int type = get16(entry + 2);
+            long long count = get32(entry + 4);
+            long long value = type == 3 ? get16(entry + 8) : get32(entry + 8);//SHORT or LONG
+            if(tag == 0x0103){
+                compression = value;
+            }
+            else if(tag == 0x0111 && count == 1){//StripOffsets
+                stripOffset = value;
+            }
+            else if(tag == 0x0117 && count == 1){//StripByteCounts
+                stripLength = value;
+            }
+            else if(tag == 0x0201){//JPEGInterchangeFormat
+                jpegOffset = value;
+            }
+            else if(tag == 0x0202){//JPEGInterchangeFormatLength
+                jpegLength = value;
+            }
+            else if(tag == 0x014A){//SubIFDs, stored inline when there is only one
+                if(count == 1){
+                    pending.push_back(get32(entry + 8));
+                }
+                else if(count > 1 && count <= 16){
+                    unsigned char offsets[64];
+                    if(read(get32(entry + 8), offsets, count * 4)){
+                        for(long long j = 0; j < count; j++){
+                            pending.push_back(get32(offsets + j * 4));
+                        }
+                    }
+                }
+            }
+        }
+        pending.push_back(get32(entries.data() + entryCount * 12));
+        
+        long long candidates[2][2] = {{jpegOffset, jpegLength}, {compression == 6 || compression == 7 ? stripOffset : 0, stripLength}};
+        for(const auto& candidate : candidates){
+            if(candidate[0] <= 0 || candidate[1] <= 0 || candidate[0] + candidate[1] > fileLength){//lengths come straight from the tags
+                continue;
+            }
+            long long offset = candidate[0];
+            ByteReader previewRead = [&read, offset](long long position, unsigned char* destination, size_t length){ return read(offset + position, destination, length); };
+            int candidateWidth, candidateHeight, frameMarker;
+            if(!ParseJpegDimensions(previewRead, candidateWidth, candidateHeight, frameMarker) || frameMarker > 0xC2){
+                continue;
+            }
+            if((long long)candidateWidth * candidateHeight > bestArea){
+                bestArea = (long long)candidateWidth * candidateHeight;
+                width = candidateWidth;
+                height = candidateHeight;
+                previewOffset = candidate[0];
+                previewLength = candidate[1];
+            }
+        }
+    }
+    return bestArea > 0;
+}
+
+//Parses dimensions from head where it covers the header, reading the rest of the file only when it doesn't
+bool ReadImageDimensions(const string& fileName, Image& image, const unsigned char* head, size_t headLength){
+    int fileDescriptor = -1;
+    ByteReader read = [&](long long offset, unsigned char* destination, size_t length){
+        if(head != NULL && offset + length <= headLength){
+            memcpy(destination, head + offset, length);
+            return true;
+        }
+        if(fileDescriptor < 0 && (fileDescriptor = open(fileName.c_str(), O_RDONLY | O_CLOEXEC)) < 0){
+            return false;
+        }
+        return pread(fileDescriptor, destination, length, offset) == (ssize_t)length;
+    };
+    
+    bool isFound = ParseImageDimensions(read, image.fileSize, image.width, image.height, image.previewOffset, image.previewLength);
+    if(fileDescriptor >= 0){
+        close(fileDescriptor);
+    }
+    return isFound;
+}
+
+bool ReadPreview(const Image& image, vector<unsigned char>& buffer){
+    int fileDescriptor = open(image.fileName.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fileDescriptor < 0){
+        return false;
+    }
+    buffer.resize(image.previewLength);
+    bool isRead = pread(fileDescriptor, buffer.data(), buffer.size(), image.previewOffset) == (ssize_t)buffer.size();
+    close(fileDescriptor);
+    return isRead;
+}
+
+//Decodes a JPEG or PNG held in memory into an 8-bit, 3 channel image.  JPEGs are decoded at the smallest
+//libjpeg scale (down to 1/8) that keeps both sides at least minimumLength; 0 means full size.
+bool DecodeImageBuffer(const unsigned char* data, size_t length, CImg<unsigned char>& image, int minimumLength){
+#ifdef cimg_use_jpeg
+    if(length >= 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF){
+        return DecodeJpeg(data, length, image, minimumLength);
+    }
+#endif
+#ifdef cimg_use_png
+    if(length >= 8 && memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0){
+        return DecodePng(data, length, image);
+    }
+#endif
+    return false;
+}
+
+//Locates the JPEG thumbnail in IFD1 of an APP1/EXIF segment within data
+bool FindExifThumbnail(const unsigned char* data, size_t length, const unsigned char*& thumbnail, size_t& thumbnailLength){
+    size_t position = 2;
+    while(position + 4 <= length && data[position] == 0xFF){
+        int marker = data[position + 1];
+        size_t segmentLength = (data[position + 2] << 8) | data[position + 3];
+        if(marker == 0xDA || marker == 0xD9 || segmentLength < 2){
+            return false;
+        }
+        size_t segmentEnd = min(length, position + 2 + segmentLength);
+        
+        const unsigned char* tiff = data + position + 10;//after marker, length and "Exif\0\0"
+        if(marker == 0xE1 && position + 18 <= segmentEnd && memcmp(data + position + 4, "Exif\0\0", 6) == 0){
+            size_t tiffLength = segmentEnd - (position + 10);
+            bool isLittleEndian = tiff[0] == 'I';
+            auto read16 = [&](size_t offset){ return isLittleEndian ? tiff[offset] | (tiff[offset + 1] << 8) : (tiff[offset] << 8) | tiff[offset + 1]; };
+            auto read32 = [&](size_t offset){
+                return isLittleEndian ? (size_t)read16(offset) | ((size_t)read16(offset + 2) << 16) : ((size_t)read16(offset) << 16) | (size_t)read16(offset + 2);
+            };
+            
+            //skip IFD0 to reach IFD1, which describes the thumbnail
+            size_t ifd = read32(4);
+            if(ifd + 2 > tiffLength){
+                return false;
+            }
+            size_t next = ifd + 2 + read16(ifd) * 12;
+            if(next + 4 > tiffLength || (ifd = read32(next)) == 0 || ifd + 2 > tiffLength){
+                return false;
+            }
+            
+            size_t thumbnailOffset = 0;
+            thumbnailLength = 0;
+            int entryCount = read16(ifd);
+            for(int i = 0; i < entryCount && ifd + 2 + (i + 1) * 12 <= tiffLength; i++){
+                size_t entry = ifd + 2 + i * 12;
+                int tag = read16(entry);
+                if(tag == 0x0201){//JPEGInterchangeFormat
+                    thumbnailOffset = read32(entry + 8);
+                }
+                else if(tag == 0x0202){//JPEGInterchangeFormatLength
+                    thumbnailLength = read32(entry + 8);
+                }
+            }
+            if(thumbnailOffset == 0 || thumbnailLength == 0 || thumbnailOffset + thumbnailLength > tiffLength){
+                return false;
+            }
+            thumbnail = tiff + thumbnailOffset;
+            return true;
+        }
+        position += 2 + segmentLength;
+    }
+    return false;
+}
+
+//Profiles a JPEG from the thumbnail in the head of the file read by the probe, as long as the thumbnail has the
+//same aspect ratio as the full image (no letterboxing or cropping)
+bool ProfileFromExifThumbnail(Image& image, const unsigned char* head, size_t headLength){
+    const unsigned char* thumbnail;
+    size_t thumbnailLength;
+    CImg<unsigned char> thumbnailCImg;
+    if(head == NULL || !FindExifThumbnail(head, headLength, thumbnail, thumbnailLength) || !DecodeImageBuffer(thumbnail, thumbnailLength, thumbnailCImg, 0)){
+        return false;
+    }
+    return ProfileFromThumbnail(image, thumbnailCImg);
+}
+
+//Profiles an image from its freedesktop.org thumbnail (large, else normal), which is only trusted while its
+//Thumb::MTime still equals the file's modification time
+bool ProfileFromThumbnailCache(Image& image){
+    struct stat fileInfo;
+    if(stat(image.fileName.c_str(), &fileInfo) != 0){
+        return false;
+    }
+    string mtime = to_string((long long)fileInfo.st_mtime);
+    string thumbnailName = Md5Hex(GetFileUri(image.fileName)) + ".png";
+    
+    for(const char* size : {"large/", "normal/"}){
+        ifstream thumbnailFile((thumbnailCacheDirectory + size + thumbnailName).c_str(), ios::binary);
+        if(!thumbnailFile){
+            continue;
+        }
+        vector<unsigned char> data((istreambuf_iterator<char>(thumbnailFile)), istreambuf_iterator<char>());
+        string thumbnailMtime;
+        CImg<unsigned char> thumbnailCImg;
+        if(FindPngText(data.data(), data.size(), "Thumb::MTime", thumbnailMtime) && thumbnailMtime == mtime
+            && DecodeImageBuffer(data.data(), data.size(), thumbnailCImg, 0)){
+            return ProfileFromThumbnail(image, thumbnailCImg);
+        }
+    }
+    return false;
+}
+
+//Uses a thumbnail in place of the full image as long as it has the same aspect ratio (no letterboxing or cropping)
+bool ProfileFromThumbnail(Image& image, const CImg<unsigned char>& thumbnail){
+    if(thumbnail.width() < 16 || thumbnail.height() < 16){
+        return false;
+    }
+    float thumbnailAspectRatio = (float)thumbnail.width() / thumbnail.height();
+    if(abs(thumbnailAspectRatio - GetAspectRatio(image)) > 0.01f * GetAspectRatio(image)){
+        return false;
+    }
+    image.smallProfile = CreateProfile(thumbnail, 1);
+    if(KeepsGridThumbnails()){
+        StoreGridThumbnail(image, thumbnail);
+    }
+    return true;
+}
+
+//The file:// URI the thumbnail specification hashes: an absolute path with "." and ".." resolved and every byte
+//percent-encoded except the ones GLib's g_filename_to_uri leaves alone, since that is what thumbnailers hash
+string GetFileUri(const string& fileName){
+    string uri = "file://";
+    const char* hexDigits = "0123456789ABCDEF";
+    for(const string& part : GetAbsolutePathSegments(fileName)){
+        uri += '/';
+        for(unsigned char c : part){
+            if(isalnum(c) || strchr("!$&'()*+,-.:=@_~", c) != NULL){
+                uri += c;
+            }
+            else{
+                uri += '%';
+                uri += hexDigits[c >> 4];
+                uri += hexDigits[c & 15];
+            }
+        }
+    }
+    return uri;
+}
+
+//Components of fileName's absolute path, with "." and ".." resolved textually (symlinks are left alone)
+vector<string> GetAbsolutePathSegments(const string& fileName){
+    string path = fileName;
+    if(path.size() == 0 || path[0] != '/'){
+        char* currentDirectory = getcwd(NULL, 0);
+        path = JoinPath(currentDirectory != NULL ? currentDirectory : "/", path);
+        free(currentDirectory);
+    }
+    
+    vector<string> segments;
+    istringstream pathStream(path);
+    string segment;
+    while(getline(pathStream, segment, '/')){
+        if(segment.size() == 0 || segment == "."){
+            continue;
+        }
+        if(segment == ".."){
+            if(segments.size() > 0){
+                segments.pop_back();
+            }
+            continue;
+        }
+        segments.push_back(segment);
+    }
+    return segments;
+}
+
+//Finds the value of a PNG tEXt chunk
+bool FindPngText(const unsigned char* data, size_t length, const string& keyword, string& text){
+    size_t position = 8;//signature
+    if(length < position || memcmp(data, "\x89PNG\r\n\x1a\n", 8) != 0){
+        return false;
+    }
+    while(position + 12 <= length){
+        size_t chunkLength = ((size_t)data[position] << 24) | (data[position + 1] << 16) | (data[position + 2] << 8) | data[position + 3];
+        const unsigned char* type = data + position + 4;
+        const char* chunk = (const char*)data + position + 8;
+        if(chunkLength > length - position - 12 || memcmp(type, "IEND", 4) == 0){
+            return false;
+        }
+        if(memcmp(type, "tEXt", 4) == 0 && chunkLength > keyword.size() && memcmp(chunk, keyword.c_str(), keyword.size() + 1) == 0){
+            text.assign(chunk + keyword.size() + 1, chunkLength - keyword.size() - 1);
+            return true;
+        }
+        position += chunkLength + 12;//length, type, data and CRC
+    }
+    return false;
+}
+
+#ifdef cimg_use_jpeg
+struct JpegErrorManager{
+    struct jpeg_error_mgr manager;
+    jmp_buf jump;
+};
+
+void OnJpegError(j_common_ptr info){
+    longjmp(((JpegErrorManager*)info->err)->jump, 1);
+}
+
+void OnJpegMessage(j_common_ptr info){
+}
+
+bool DecodeJpeg(const unsigned char* data, size_t length, CImg<unsigned char>& image, int minimumLength){
+    struct jpeg_decompress_struct info;
+    JpegErrorManager error;
+    info.err = jpeg_std_error(&error.manager);
+    error.manager.error_exit = OnJpegError;
+    error.manager.output_message = OnJpegMessage;
+    if(setjmp(error.jump)){
+        jpeg_destroy_decompress(&info);
+        return false;
+    }
+    
+    jpeg_create_decompress(&info);
+    jpeg_mem_src(&info, (unsigned char*)data, length);
+    jpeg_read_header(&info, TRUE);
+    if(info.jpeg_color_space == JCS_CMYK || info.jpeg_color_space == JCS_YCCK){//left to CImg, which handles the conversion
+        jpeg_destroy_decompress(&info);
+        return false;
+    }
+    info.out_color_space = info.jpeg_color_space == JCS_GRAYSCALE ? JCS_GRAYSCALE : JCS_RGB;
+    if(minimumLength > 0){
+        info.scale_num = 1;
+        info.scale_denom = 1;
+        while(info.scale_denom < 8 && (int)min(info.image_width, info.image_height) / (int)(info.scale_denom * 2) >= minimumLength){
+            info.scale_denom *= 2;
+        }
+    }
+    jpeg_start_decompress(&info);
+    
+    image.assign(info.output_width, info.output_height, 1, 3);
+    JSAMPARRAY row = (*info.mem->alloc_sarray)((j_common_ptr)&info, JPOOL_IMAGE, info.output_width * info.output_components, 1);
+    unsigned char* red = image.data(0, 0, 0, 0);
+    unsigned char* green = image.data(0, 0, 0, 1);
+    unsigned char* blue = image.data(0, 0, 0, 2);
+    while(info.output_scanline < info.output_height){
+        jpeg_read_scanlines(&info, row, 1);
+        const unsigned char* pixel = row[0];
+        for(unsigned int x = 0; x < info.output_width; x++){
+            if(info.output_components == 1){
+                *red++ = *green++ = *blue++ = *pixel++;
+            }
+            else{
+                *red++ = *pixel++;
+                *green++ = *pixel++;
+                *blue++ = *pixel++;
+            }
+        }
+    }
+    
+    jpeg_finish_decompress(&info);
+    jpeg_destroy_decompress(&info);
+    return true;
+}
+
+bool EncodeJpeg(const CImg<unsigned char>& image, int quality, string& output){
+    struct jpeg_compress_struct info;
+    JpegErrorManager error;
+    unsigned char* buffer = NULL;
+    unsigned long length = 0;
+    info.err = jpeg_std_error(&error.manager);
+    error.manager.error_exit = OnJpegError;
+    error.manager.output_message = OnJpegMessage;
+    if(setjmp(error.jump)){
+        jpeg_destroy_compress(&info);
+        free(buffer);
+        return false;
+    }
+    
+    jpeg_create_compress(&info);
+    jpeg_mem_dest(&info, &buffer, &length);
+    info.image_width = image.width();
+    info.image_height = image.height();
+    info.input_components = 3;
+    info.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&info);
+    jpeg_set_quality(&info, quality, TRUE);
+    jpeg_start_compress(&info, TRUE);
+    
+    vector<unsigned char> row(image.width() * 3);
+    while(info.next_scanline < info.image_height){
+        for(int x = 0; x < image.width(); x++){
+            for(int c = 0; c < 3; c++){
+                row[x * 3 + c] = image(x, info.next_scanline, 0, min(c, image.spectrum() - 1));
+            }
+        }
+        JSAMPROW rowPointer = row.data();
+        jpeg_write_scanlines(&info, &rowPointer, 1);
+    }
+    
+    jpeg_finish_compress(&info);
+    jpeg_destroy_compress(&info);
+    output.assign((const char*)buffer, length);
+    free(buffer);
+    return true;
+}
+#endif
+
+#ifdef cimg_use_png
+struct PngSource{
+    const unsigned char* data;
+    size_t length;
+    size_t position;
+};
+
+void ReadPngData(png_structp png, png_bytep destination, png_size_t length){
+    PngSource* source = (PngSource*)png_get_io_ptr(png);
+    if(source->position + length > source->length){
+        png_error(png, "truncated");
+    }
+    memcpy(destination, source->data + source->position, length);
+    source->position += length;
+}
+
+void OnPngError(png_structp png, png_const_charp message){
+    png_longjmp(png, 1);
+}
+
+void OnPngWarning(png_structp png, png_const_charp message){
+}
+
+bool DecodePng(const unsigned char* data, size_t length, CImg<unsigned char>& image){
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, OnPngError, OnPngWarning);
+    png_infop info = png != NULL ? png_create_info_struct(png) : NULL;
+    if(info == NULL){
+        png_destroy_read_struct(&png, NULL, NULL);
+        return false;
+    }
+    
+    PngSource source = {data, length, 0};
+    vector<unsigned char> pixels;
+    vector<png_bytep> rows;
+    if(setjmp(png_jmpbuf(png))){
+        png_destroy_read_struct(&png, &info, NULL);
+        return false;
+    }
+    
+    png_set_read_fn(png, &source, ReadPngData);
+    png_read_info(png, info);
+    png_set_expand(png);
+    png_set_strip_16(png);
+    png_set_strip_alpha(png);
+    png_set_gray_to_rgb(png);
+    png_set_interlace_handling(png);
+    png_read_update_info(png, info);
+    
+    unsigned int width = png_get_image_width(png, info);
+    unsigned int height = png_get_image_height(png, info);
+    size_t rowLength = png_get_rowbytes(png, info);
+    if(rowLength != (size_t)width * 3){
+        png_destroy_read_struct(&png, &info, NULL);
+        return false;
+    }
+    
+    //Interlaced images need every pass in memory at once; otherwise rows are split into channels as they are read,
+    //so only the planar image is ever held in full
+    bool isInterlaced = png_get_interlace_type(png, info) != PNG_INTERLACE_NONE;
+    pixels.resize(isInterlaced ? rowLength * height : rowLength);
+    if(isInterlaced){
+        rows.resize(height);
+        for(unsigned int y = 0; y < height; y++){
+            rows[y] = &pixels[y * rowLength];
+        }
+        png_read_image(png, rows.data());
+    }
+    
+    image.assign(width, height, 1, 3);
+    unsigned char* red = image.data(0, 0, 0, 0);
+    unsigned char* green = image.data(0, 0, 0, 1);
+    unsigned char* blue = image.data(0, 0, 0, 2);
+    for(unsigned int y = 0; y < height; y++){
+        const unsigned char* pixel = isInterlaced ? rows[y] : pixels.data();
+        if(!isInterlaced){
+            png_read_row(png, pixels.data(), NULL);
+        }
+        for(unsigned int x = 0; x < width; x++){
+            *red++ = *pixel++;
+            *green++ = *pixel++;
+            *blue++ = *pixel++;
+        }
+    }
+    png_read_end(png, NULL);
+    png_destroy_read_struct(&png, &info, NULL);
+    return true;
+}
+#endif
+
+long long factorial(int x){
+    if(x <= 0){
+        return 0;
+    }
+
+    long long result = x;
+    
+    while(x > 1){
+        x--;
+        result *= x;
+    }
+
+    return result;
+}
+
+//Groups byte-identical files by size, then by a hash of their first 4 KiB, then by a hash of their full contents.
+//Every file but the first of each group is removed from files, so only one copy per group gets decoded.
+vector<vector<string>> FindExactDuplicates(vector<string>& files){
+    const size_t headLength = 4096;
+    map<long long, vector<string>> sizeGroups;
+    for(const string& fileName : files){
+        struct stat fileStat;
+        if(stat(fileName.c_str(), &fileStat) == 0){
+            sizeGroups[fileStat.st_size].push_back(fileName);
+        }
+    }
+    
+    vector<vector<string>> duplicateGroups;
+    set<string> redundantFiles;
+    for(const auto& sizeGroup : sizeGroups){
+        if(sizeGroup.second.size() < 2){
+            continue;
+        }
+        
+        map<unsigned long long, vector<string>> headGroups;
+        for(const string& fileName : sizeGroup.second){
+            unsigned long long hash;
+            if(HashFile(fileName, headLength, hash)){
+                headGroups[hash].push_back(fileName);
+            }
+        }
+        
+        for(const auto& headGroup : headGroups){
+            if(headGroup.second.size() < 2){
+                continue;
+            }
+            
+            map<unsigned long long, vector<string>> contentGroups;
+            if(sizeGroup.first <= (long long)headLength){
+                contentGroups[headGroup.first] = headGroup.second;//the head hash already covered the whole file
+            }
+            else{
+                for(const string& fileName : headGroup.second){
+                    unsigned long long hash;
+                    if(HashFile(fileName, 0, hash)){
+                        contentGroups[hash].push_back(fileName);
+                    }
+                }
+            }
+            
+            for(const auto& contentGroup : contentGroups){
+                if(contentGroup.second.size() < 2){
+                    continue;
+                }
+                duplicateGroups.push_back(contentGroup.second);
+                redundantFiles.insert(contentGroup.second.begin() + 1, contentGroup.second.end());
+            }
+        }
+    }
+    
+    files.erase(remove_if(files.begin(), files.end(), [&redundantFiles](const string& fileName){ return redundantFiles.count(fileName) > 0; }), files.end());
+    return duplicateGroups;
+}
+
+//Hashes the first limit bytes of a file, or all of it when limit is 0
+bool HashFile(const string& fileName, size_t limit, unsigned long long& hash){
+    FILE* file = fopen(fileName.c_str(), "rb");
+    if(file == NULL){
+        return false;
+    }
+    
+    vector<unsigned char> buffer(limit > 0 ? limit : 1 << 20);
+    hash = 0;
+    size_t totalRead = 0;
+    size_t bytesRead;
+    while((limit == 0 || totalRead < limit) && (bytesRead = fread(buffer.data(), 1, buffer.size(), file)) > 0){
+        hash = HashBytes(buffer.data(), bytesRead, hash);//each chunk is seeded with the hash of everything before it
+        totalRead += bytesRead;
+    }
+    bool isValid = !ferror(file);
+    fclose(file);
+    return isValid;
+}
+
+//Profile attribute layout, little-endian: version(1) profile method(1) cell count(2) width(4) height(4)
+//mtime seconds(8) mtime nanoseconds(4) size(8) preview offset(8) preview length(8), then 3 bytes per cell.  The
+//attribute travels with the file through renames; a changed mtime or size makes it stale.
+const size_t profileAttributeHeaderLength = 48;
+
+//The grid thumbnail has an attribute of its own, mtime seconds(8) mtime nanoseconds(4) size(8) then the JPEG, since
+//some filesystems limit a value to a few KB and the profile must still fit when the thumbnail doesn't
+const char* const thumbnailAttributeName = "user.difdif.thumbnail";
+const size_t thumbnailAttributeHeaderLength = 20;
+
+//Each profile method has its own attribute, so switching between them doesn't overwrite the other's profiles
+const char* GetProfileAttributeName(){
+    return usesAreaAverageProfile ? "user.difdif.area" : "user.difdif.nearest";
+}
+
+void RecordFileState(Image& image, const struct stat& fileInfo){
+    image.fileSize = fileInfo.st_size;
+    image.mtimeSeconds = fileInfo.st_mtim.tv_sec;
+    image.mtimeNanoseconds = fileInfo.st_mtim.tv_nsec;
+}
+
+bool LoadStoredProfile(const string& fileName, Image& image){
+    struct stat fileInfo;
+    unsigned char attribute[4096];
+    if(stat(fileName.c_str(), &fileInfo) != 0){
+        return false;
+    }
+    ssize_t length = getxattr(fileName.c_str(), GetProfileAttributeName(), attribute, sizeof(attribute));
+    if(length < (ssize_t)profileAttributeHeaderLength || attribute[0] != profileAttributeVersion || attribute[1] != (usesAreaAverageProfile ? 1 : 0)){
+        return false;
+    }
+    auto get = [&attribute](size_t offset, int byteCount){
+        unsigned long long value = 0;
+        for(int i = byteCount - 1; i >= 0; i--){
+            value = (value << 8) | attribute[offset + i];
+        }
+        return value;
+    };
+    size_t cellCount = get(2, 2);
+    if((size_t)length != profileAttributeHeaderLength + cellCount * 3 || (long long)get(12, 8) != (long long)fileInfo.st_mtim.tv_sec
+        || (long long)get(20, 4) != (long long)fileInfo.st_mtim.tv_nsec || (long long)get(24, 8) != (long long)fileInfo.st_size){
+        return false;
+    }
+    
+    image.fileName = fileName;
+    RecordFileState(image, fileInfo);
+    image.width = get(4, 4);
+    image.height = get(8, 4);
+    image.previewOffset = get(32, 8);
+    image.previewLength = get(40, 8);
+    image.smallProfile.assign(cellCount, vector<int>(3));
+    const unsigned char* cells = attribute + profileAttributeHeaderLength;
+    for(size_t i = 0; i < cellCount; i++){
+        for(int c = 0; c < 3; c++){
+            image.smallProfile[i][c] = *cells++;
+        }
+    }
+    if(usesMatchGrid || bandFileName.size() > 0){
+        LoadStoredThumbnail(image, fileInfo);
+    }
+    return image.width > 0 && image.height > 0;
+}
+
+bool LoadStoredThumbnail(Image& image, const struct stat& fileInfo){
+    vector<unsigned char> attribute(64 << 10);
+    ssize_t length = getxattr(image.fileName.c_str(), thumbnailAttributeName, attribute.data(), attribute.size());
+    if(length <= (ssize_t)thumbnailAttributeHeaderLength){
+        return false;
+    }
+    auto get = [&attribute](size_t offset, int byteCount){
+        unsigned long long value = 0;
+        for(int i = byteCount - 1; i >= 0; i--){
+            value = (value << 8) | attribute[offset + i];
+        }
+        return value;
+    };
+    if((long long)get(0, 8) != (long long)fileInfo.st_mtim.tv_sec || (long long)get(8, 4) != (long long)fileInfo.st_mtim.tv_nsec
+        || (long long)get(12, 8) != (long long)fileInfo.st_size){
+        return false;
+    }
+    image.thumbnail.assign((const char*)attribute.data() + thumbnailAttributeHeaderLength, length - thumbnailAttributeHeaderLength);
+    return true;
+}
+
+//Fails quietly, like StoreProfile
+void StoreThumbnail(const Image& image, const struct stat& fileInfo){
+    string attribute;
+    AppendLittleEndian(attribute, fileInfo.st_mtim.tv_sec, 8);
+    AppendLittleEndian(attribute, fileInfo.st_mtim.tv_nsec, 4);
+    AppendLittleEndian(attribute, fileInfo.st_size, 8);
+    attribute += image.thumbnail;
+    setxattr(image.fileName.c_str(), thumbnailAttributeName, attribute.data(), attribute.size(), 0);
+}
+
+//Fails quietly on filesystems without user xattrs and on files that can't be written
+bool StoreProfile(const Image& image){
+    struct stat fileInfo;
+    if(stat(image.fileName.c_str(), &fileInfo) != 0){
+        return false;
+    }
+    vector<unsigned char> attribute;
+    auto put = [&attribute](unsigned long long value, int byteCount){
+        for(int i = 0; i < byteCount; i++){
+            attribute.push_back((unsigned char)(value >> (8 * i)));
+        }
+    };
+    put(profileAttributeVersion, 1);
+    put(usesAreaAverageProfile ? 1 : 0, 1);
+    put(image.smallProfile.size(), 2);
+    put(image.width, 4);
+    put(image.height, 4);
+    put(fileInfo.st_mtim.tv_sec, 8);
+    put(fileInfo.st_mtim.tv_nsec, 4);
+    put(fileInfo.st_size, 8);
+    put(image.previewOffset, 8);
+    put(image.previewLength, 8);
+    for(const vector<int>& cell : image.smallProfile){
+        for(int c = 0; c < 3; c++){
+            put(cell[c], 1);
+        }
+    }
+    if(image.thumbnail.size() > 0){
+        StoreThumbnail(image, fileInfo);
+    }
+    return setxattr(image.fileName.c_str(), GetProfileAttributeName(), attribute.data(), attribute.size(), 0) == 0;
+}
+
+//RFC 1321, as lowercase hex
+string Md5Hex(const string& input){
+    static const unsigned int shifts[64] = {7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+        4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21};
+    unsigned int constants[64];
+    for(int i = 0; i < 64; i++){
+        constants[i] = (unsigned int)(fabs(sin(i + 1.0)) * 4294967296.0);
+    }
+    
+    string message = input;
+    unsigned long long bitLength = (unsigned long long)input.size() * 8;
+    message += (char)0x80;
+    while(message.size() % 64 != 56){
+        message += (char)0;
+    }
+    for(int i = 0; i < 8; i++){
+        message += (char)(bitLength >> (8 * i));
+    }
+    
+    unsigned int state[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    for(size_t block = 0; block < message.size(); block += 64){
+        unsigned int words[16];
+        for(int i = 0; i < 16; i++){
+            const unsigned char* bytes = (const unsigned char*)message.data() + block + i * 4;
+            words[i] = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((unsigned int)bytes[3] << 24);
+        }
+        unsigned int a = state[0], b = state[1], c = state[2], d = state[3];
+        for(int i = 0; i < 64; i++){
+            unsigned int f;
+            int g;
+            if(i < 16){
+                f = (b & c) | (~b & d);
+                g = i;
+            }
+            else if(i < 32){
+                f = (d & b) | (~d & c);
+                g = (5 * i + 1) % 16;
+            }
+            else if(i < 48){
+                f = b ^ c ^ d;
+                g = (3 * i + 5) % 16;
+            }
+            else{
+                f = c ^ (b | ~d);
+                g = (7 * i) % 16;
+            }
+            f += a + constants[i] + words[g];
+            a = d;
+            d = c;
+            c = b;
+            b += (f << shifts[i]) | (f >> (32 - shifts[i]));
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+    }
+    
+    string hex;
+    const char* hexDigits = "0123456789abcdef";
+    for(unsigned int word : state){
+        for(int i = 0; i < 4; i++){
+            unsigned char byte = word >> (8 * i);
+            hex += hexDigits[byte >> 4];
+            hex += hexDigits[byte & 15];
+        }
+    }
+    return hex;
+}
+
+//XXH64
+unsigned long long HashBytes(const unsigned char* data, size_t length, unsigned long long seed){
+    const unsigned long long prime1 = 11400714785074694791ULL;
+    const unsigned long long prime2 = 14029467366897019727ULL;
+    const unsigned long long prime3 = 1609587929392839161ULL;
+    const unsigned long long prime4 = 9650029242287828579ULL;
+    const unsigned long long prime5 = 2870177450012600261ULL;
+    auto rotate = [](unsigned long long x, int bits){ return (x << bits) | (x >> (64 - bits)); };
+    auto round = [&](unsigned long long accumulator, unsigned long long input){ return rotate(accumulator + input * prime2, 31) * prime1; };
+    auto read64 = [](const unsigned char* p){ unsigned long long value; memcpy(&value, p, 8); return value; };
+    auto read32 = [](const unsigned char* p){ uint32_t value; memcpy(&value, p, 4); return (unsigned long long)value; };
+    
+    const unsigned char* position = data;
+    const unsigned char* end = data + length;
+    unsigned long long hash;
+    
+    if(length >= 32){
+        unsigned long long v1 = seed + prime1 + prime2;
+        unsigned long long v2 = seed + prime2;
+        unsigned long long v3 = seed;
+        unsigned long long v4 = seed - prime1;
+        do{
+            v1 = round(v1, read64(position));
+            v2 = round(v2, read64(position + 8));
+            v3 = round(v3, read64(position + 16));
+            v4 = round(v4, read64(position + 24));
+            position += 32;
+        }while(position + 32 <= end);
+        
+        hash = rotate(v1, 1) + rotate(v2, 7) + rotate(v3, 12) + rotate(v4, 18);
+        for(unsigned long long v : {v1, v2, v3, v4}){
+            hash = (hash ^ round(0, v)) * prime1 + prime4;
+        }
+    }
+    else{
+        hash = seed + prime5;
+    }
+    
+    hash += length;
+    for(; position + 8 <= end; position += 8){
+        hash = rotate(hash ^ round(0, read64(position)), 27) * prime1 + prime4;
+    }
+    if(position + 4 <= end){
+        hash = rotate(hash ^ (read32(position) * prime1), 23) * prime2 + prime3;
+        position += 4;
+    }
+    for(; position < end; position++){
+        hash = rotate(hash ^ (*position * prime5), 11) * prime1;
+    }
+    
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+    hash *= prime3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+vector<string> GetImageList(string path, bool isRecursive){
+    vector<string> files;
+    vector<string> directories;
+    map<string, DirectorySnapshot> visitedSnapshots;
+    
+    directories.push_back(path);
+    int maxLoops = 1000;
+    int currentLoop = 0;
+    while(directories.size() > 0){
+        path = directories[directories.size() - 1];
+        directories.pop_back();
+        
+        DirectorySnapshot snapshot;
+        if(ScanDirectory(path, (currentLoop == 0 ? true : false), snapshot)){
+            files.insert(files.end(), snapshot.images.begin(), snapshot.images.end());
+            
+            if(isRecursive){
+                directories.insert(directories.end(), snapshot.directories.begin(), snapshot.directories.end());
+            }
+            visitedSnapshots[path] = snapshot;
+        }
+        
+        currentLoop++;
+        if(currentLoop > maxLoops){
+            break;
+        }
+        
+    }
+    
+    //keep snapshots of directories outside this traversal, replace everything it visited
+    for(auto& visited : visitedSnapshots){
+        directorySnapshots[visited.first] = visited.second;
+    }
+    return files;
+}
+
+//Fills snapshot with the images and subdirectories of path, reusing the indexed listing when the directory's
+//mtime, ctime and link count are unchanged.  Returns false if the directory can't be read.
+bool ScanDirectory(const string& path, bool isFirstLevel, DirectorySnapshot& snapshot){
+    struct stat directoryStat;
+    if(stat(path.c_str(), &directoryStat) != 0){
+        return false;
+    }
+    
+    map<string, DirectorySnapshot>::iterator cached = directorySnapshots.find(path);
+    if(cached != directorySnapshots.end()
+        && cached->second.mtimeSeconds == directoryStat.st_mtim.tv_sec && cached->second.mtimeNanoseconds == directoryStat.st_mtim.tv_nsec
+        && cached->second.ctimeSeconds == directoryStat.st_ctim.tv_sec && cached->second.ctimeNanoseconds == directoryStat.st_ctim.tv_nsec
+        && cached->second.linkCount == (long long)directoryStat.st_nlink
+        && cached->second.mtimeSeconds < cached->second.scanTime){//a listing taken in the same second as a change may have missed it
+        snapshot = cached->second;
+        reusedDirectoryCount++;
+        return true;
+    }
+    
+    DIR *dirPointer = opendir(path.c_str());
+    if(dirPointer == NULL){
+        return false;
+    }
+    snapshot.mtimeSeconds = directoryStat.st_mtim.tv_sec;
+    snapshot.mtimeNanoseconds = directoryStat.st_mtim.tv_nsec;
+    snapshot.ctimeSeconds = directoryStat.st_ctim.tv_sec;
+    snapshot.ctimeNanoseconds = directoryStat.st_ctim.tv_nsec;
+    snapshot.linkCount = directoryStat.st_nlink;
+    snapshot.scanTime = time(NULL);
+    snapshot.entryCount = 0;
+    
+    string prefix = isFirstLevel ? path : path + "/";
+    struct dirent *entry;
+    while ((entry = readdir(dirPointer)) != NULL){
+        string entryName = entry->d_name;
+        if(entryName.compare(".") == 0 || entryName.compare("..") == 0){
+            continue;
+        }
+        snapshot.entryCount++;
+        if(entry->d_type == DT_DIR){
+            snapshot.directories.push_back(prefix + entryName);
+        }
+        else if(IsImageFileName(entryName)){
+            snapshot.images.push_back(prefix + entryName);
+        }
+    }
+    closedir(dirPointer);
+    
+    if(cached != directorySnapshots.end()){
+        //the listing changed, so snapshots of subdirectories that no longer exist are dropped
+        for(const string& oldDirectory : cached->second.directories){
+            if(find(snapshot.directories.begin(), snapshot.directories.end(), oldDirectory) == snapshot.directories.end()){
+                directorySnapshots.erase(oldDirectory);
+            }
+        }
+    }
+    return true;
+}
+
+//Index format: a version line, then per directory a "D" line of metadata followed by its "I"mage and "S"ubdirectory lines
+void LoadIndex(const string& fileName){
+    ifstream indexFile(fileName.c_str());
+    string line;
+    if(!getline(indexFile, line) || line.compare("difdif-index 2") != 0){
+        return;
+    }
+    
+    DirectorySnapshot* current = NULL;
+    while(getline(indexFile, line)){
+        size_t tab = line.find('\t');
+        if(tab == string::npos){
+            continue;
+        }
+        string value = line.substr(tab + 1);
+        if(line[0] == 'D'){
+            DirectorySnapshot snapshot;
+            istringstream fields(line.substr(1, tab - 1));
+            if(!(fields >> snapshot.mtimeSeconds >> snapshot.mtimeNanoseconds >> snapshot.ctimeSeconds >> snapshot.ctimeNanoseconds >> snapshot.linkCount >> snapshot.entryCount >> snapshot.scanTime)){
+                current = NULL;
+                continue;
+            }
+            current = &(directorySnapshots[value] = snapshot);
+        }
+        else if(current != NULL && line[0] == 'I'){
+            current->images.push_back(value);
+        }
+        else if(current != NULL && line[0] == 'S'){
+            current->directories.push_back(value);
+        }
+    }
+}
+
+void SaveIndex(const string& fileName){
+    string temporaryFileName = fileName + ".tmp";
+    ofstream indexFile(temporaryFileName.c_str());
+    indexFile << "difdif-index 2\n";
+    for(const auto& directory : directorySnapshots){
+        const DirectorySnapshot& snapshot = directory.second;
+        indexFile << "D " << snapshot.mtimeSeconds << " " << snapshot.mtimeNanoseconds << " " << snapshot.ctimeSeconds << " " << snapshot.ctimeNanoseconds
+            << " " << snapshot.linkCount << " " << snapshot.entryCount << " " << snapshot.scanTime << "\t" << directory.first << "\n";
+        for(const string& image : snapshot.images){
+            indexFile << "I\t" << image << "\n";
+        }
+        for(const string& subdirectory : snapshot.directories){
+            indexFile << "S\t" << subdirectory << "\n";
+        }
+    }
+    indexFile.close();
+    if(!indexFile || rename(temporaryFileName.c_str(), fileName.c_str()) != 0){
+        cout << "Unable to save index to " << fileName << "\n";
+    }
+}
+
+bool IsImageFileName(const string& name){
+    return GetImageType(name) != imageTypeNone;
+}
+
+ImageType GetImageType(const string& name){
+    for(const ImageExtension& extension : imageExtensions){
+        size_t suffixLength = strlen(extension.suffix);
+        if(name.size() > suffixLength && strcasecmp(name.c_str() + name.size() - suffixLength, extension.suffix) == 0){
+            return extension.type;
+        }
+    }
+    return imageTypeNone;
+}
+
+//Identifies a file by its first bytes rather than its name
+ImageType GetSignatureType(const unsigned char* data, size_t length){
+    if(length >= 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF){
+        return imageTypeJpeg;
+    }
+    if(length >= 8 && memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0){
+        return imageTypePng;
+    }
+    if(length >= 4 && (memcmp(data, "II*\0", 4) == 0 || memcmp(data, "MM\0*", 4) == 0)){
+        return imageTypeRaw;//CR2, NEF, ARW and DNG are all TIFF containers
+    }
+    return imageTypeNone;
+}
+
+string JoinPath(const string& directory, const string& name){
+    if(directory.size() > 0 && directory[directory.size() - 1] == '/'){
+        return directory + name;
+    }
+    return directory + "/" + name;
+}
+
+vector<string> GetDirectoriesInDirectory(const string& path, bool isFirstLevel){
+    vector<string> directoryList;
+    DIR *dirPointer;
+    struct dirent *entry;
+    dirPointer = opendir(path.c_str());
+    if(dirPointer != NULL){
+        while ((entry = readdir(dirPointer)) != NULL){
+            if(entry->d_type == DT_DIR){
+                if(string(entry->d_name).compare(".") != 0 && string(entry->d_name).compare("..") != 0){
+                    string fullDirectory;
+                    if(isFirstLevel){
+                        fullDirectory = path + entry->d_name;
+                        directoryList.push_back(path + entry->d_name);
+                    }
+                    else{
+                        fullDirectory = path + "/" + entry->d_name;
+                        directoryList.push_back(path + "/" + entry->d_name);
+                    }
+                    //cout << "Found directory: " << fullDirectory << "\n";
+                }
+            }       
         }
     }
     closedir(dirPointer);
-    return imageList;
+    return directoryList;
+}
+
+//Adds an inotify watch to path and every directory below it
+void AddWatches(int inotifyFd, const string& path, map<int, string>& watchedDirectories){
+    const uint32_t mask = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+    vector<string> directories;
+    directories.push_back(path);
+    while(directories.size() > 0){
+        string directory = directories[directories.size() - 1];
+        directories.pop_back();
+        
+        int wd = inotify_add_watch(inotifyFd, directory.c_str(), mask);
+        if(wd < 0){
+            cout << "Unable to watch " << directory << ": " << strerror(errno) << "\n";
+            continue;
+        }
+        watchedDirectories[wd] = directory;
+        
+        if(isRecursive){
+            //name subdirectories the same way GetImageList does so removals match indexed file names
+            bool isFirstLevel = directory.size() > 0 && directory[directory.size() - 1] == '/';
+            vector<string> subdirectories = GetDirectoriesInDirectory(directory, isFirstLevel);
+            directories.insert(directories.end(), subdirectories.begin(), subdirectories.end());
+        }
+    }
+}
+
+//Drops every image at or below path, along with the matches that reference them; the remaining matches are
+//renumbered to the shortened table
+int RemoveImages(const set<string>& paths, vector<Image>& images, vector<Pairing>& matches){
+    auto isRemoved = [&paths](const string& fileName){
+        if(paths.count(fileName) > 0){
+            return true;
+        }
+        for(const string& path : paths){
+            if(fileName.size() > path.size() && fileName.compare(0, path.size(), path) == 0 && fileName[path.size()] == '/'){
+                return true;
+            }
+        }
+        return false;
+    };
+    
+    const unsigned removedIndex = numeric_limits<unsigned>::max();
+    vector<unsigned> newIndices(images.size(), removedIndex);
+    size_t keptCount = 0;
+    for(size_t i = 0; i < images.size(); i++){
+        if(!isRemoved(images[i].fileName)){
+            if(keptCount != i){
+                images[keptCount] = move(images[i]);
+            }
+            newIndices[i] = keptCount++;
+        }
+    }
+    size_t originalSize = images.size();
+    images.resize(keptCount);
+    matches.erase(remove_if(matches.begin(), matches.end(), [&](const Pairing& pairing){
+        return newIndices[pairing.image1] == removedIndex || newIndices[pairing.image2] == removedIndex;
+    }), matches.end());
+    for(Pairing& pairing : matches){
+        pairing.image1 = newIndices[pairing.image1];
+        pairing.image2 = newIndices[pairing.image2];
+    }
+    return originalSize - images.size();
+}
+
+//Applies one debounced batch: removed and rewritten files leave the index first, then new files are profiled
+//and compared against everything already indexed as well as each other
+void ApplyWatchBatch(set<string>& removals, set<string>& updates, vector<Image>& images, vector<Pairing>& matches){
+    set<string> stale = removals;
+    stale.insert(updates.begin(), updates.end());
+    int removedCount = RemoveImages(stale, images, matches);
+    
+    vector<string> updatedFiles;
+    for(const string& fileName : updates){
+        struct stat fileStat;
+        if(stat(fileName.c_str(), &fileStat) == 0 && S_ISREG(fileStat.st_mode)){
+            updatedFiles.push_back(fileName);
+        }
+    }
+    vector<string> ignoredImages;
+    vector<Image> newImages = ProfileFiles(updatedFiles, ignoredImages, set<string>(), false);
+    
+    int newMatchCount = 0;
+    size_t existingCount = images.size();
+    images.insert(images.end(), newImages.begin(), newImages.end());
+    for(size_t j = existingCount; j < images.size(); j++){
+        for(size_t i = 0; i < j; i++){
+            float similarity = GetSimilarity(images[i], images[j]);
+            if(similarity > minimumSimilarity){
+                cout << images[i].fileName << " and " << images[j].fileName << " are " << similarity << " % similar.\n";
+                matches.push_back(Pairing(i, j, similarity));
+                newMatchCount++;
+            }
+        }
+    }
+    
+    cout << newImages.size() << " image(s) added, " << removedCount << " removed or replaced, " << newMatchCount << " new match(es).  " << images.size() << " images and " << matches.size() << " matches indexed.\n";
+    removals.clear();
+    updates.clear();
+}
+
+void WatchDirectory(const string& path, vector<Image>& images, vector<Pairing>& matches){
+    int inotifyFd = inotify_init1(IN_CLOEXEC);
+    if(inotifyFd < 0){
+        cout << "Unable to start watching: " << strerror(errno) << "\n";
+        return;
+    }
+    
+    map<int, string> watchedDirectories;
+    AddWatches(inotifyFd, path, watchedDirectories);
+    cout << "Watching " << watchedDirectories.size() << " directories under \"" << path << "\" for changes.  Press Ctrl-C to stop.\n";
+    
+    set<string> removals;
+    set<string> updates;
+    bool isBatchOpen = false;
+    chrono::steady_clock::time_point firstPendingEvent, lastPendingEvent;
+    alignas(struct inotify_event) char buffer[65536];
+    auto openBatch = [&](){
+        lastPendingEvent = chrono::steady_clock::now();
+        if(!isBatchOpen){
+            firstPendingEvent = lastPendingEvent;
+            isBatchOpen = true;
+        }
+    };
+    
+    while(!watchedDirectories.empty()){
+        int timeout = -1;
+        if(isBatchOpen){
+            chrono::steady_clock::time_point now = chrono::steady_clock::now();
+            long long sinceLast = chrono::duration_cast<chrono::milliseconds>(now - lastPendingEvent).count();
+            long long sinceFirst = chrono::duration_cast<chrono::milliseconds>(now - firstPendingEvent).count();
+            timeout = max(0LL, min(watchDebounceMilliseconds - sinceLast, watchMaxBatchDelayMilliseconds - sinceFirst));
+        }
+        
+        struct pollfd pollTarget = {inotifyFd, POLLIN, 0};
+        int ready = poll(&pollTarget, 1, timeout);
+        if(ready < 0 && errno != EINTR){
+            cout << "Error while watching: " << strerror(errno) << "\n";
+            break;
+        }
+        
+        if(ready > 0){
+            ssize_t length = read(inotifyFd, buffer, sizeof(buffer));
+            for(char* position = buffer; length > 0 && position < buffer + length; ){
+                struct inotify_event* event = (struct inotify_event*)position;
+                position += sizeof(struct inotify_event) + event->len;
+                
+                if(event->mask & IN_Q_OVERFLOW){
+                    //the kernel dropped events, so compare the whole tree against the index instead
+                    cout << "Too many changes to follow.  Rescanning \"" << path << "\"...\n";
+                    AddWatches(inotifyFd, path, watchedDirectories);
+                    vector<string> fileNames = GetImageList(path, isRecursive);
+                    set<string> onDisk(fileNames.begin(), fileNames.end());
+                    map<string, const Image*> indexed;
+                    for(const Image& image : images){
+                        indexed[image.fileName] = &image;
+                    }
+                    for(const string& fileName : onDisk){
+                        map<string, const Image*>::iterator entry = indexed.find(fileName);
+                        struct stat fileInfo;
+                        if(entry == indexed.end()){
+                            updates.insert(fileName);
+                        }
+                        else if(stat(fileName.c_str(), &fileInfo) == 0 && (fileInfo.st_size != entry->second->fileSize
+                            || fileInfo.st_mtim.tv_sec != entry->second->mtimeSeconds || fileInfo.st_mtim.tv_nsec != entry->second->mtimeNanoseconds)){
+                            updates.insert(fileName);//rewritten in place
+                        }
+                    }
+                    for(const auto& entry : indexed){
+                        if(onDisk.count(entry.first) == 0){
+                            removals.insert(entry.first);
+                            updates.erase(entry.first);
+                        }
+                    }
+                    openBatch();
+                    continue;
+                }
+                map<int, string>::iterator watched = watchedDirectories.find(event->wd);
+                if(watched == watchedDirectories.end()){
+                    continue;
+                }
+                if(event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)){
+                    if(event->mask & IN_IGNORED){
+                        watchedDirectories.erase(watched);
+                    }
+                    continue;
+                }
+                if(event->len == 0){
+                    continue;
+                }
+                
+                string entryPath = JoinPath(watched->second, event->name);
+                bool isChange = false;
+                if(event->mask & IN_ISDIR){
+                    if(event->mask & (IN_DELETE | IN_MOVED_FROM)){
+                        removals.insert(entryPath);
+                        isChange = true;
+                    }
+                    else if(isRecursive && (event->mask & (IN_CREATE | IN_MOVED_TO))){
+                        //files may have landed before the watch existed, so pick up what is already there
+                        AddWatches(inotifyFd, entryPath, watchedDirectories);
+                        for(string fileName : GetImageList(entryPath + "/", isRecursive)){
+                            updates.insert(fileName);
+                        }
+                        isChange = true;
+                    }
+                }
+                else if(IsImageFileName(event->name)){
+                    if(event->mask & (IN_DELETE | IN_MOVED_FROM)){
+                        removals.insert(entryPath);
+                        updates.erase(entryPath);
+                        isChange = true;
+                    }
+                    else if(event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)){
+                        updates.insert(entryPath);
+                        isChange = true;
+                    }
+                }
+                
+                if(isChange){
+                    openBatch();
+                }
+            }
+        }
+        
+        if(isBatchOpen){
+            chrono::steady_clock::time_point now = chrono::steady_clock::now();
+            if(now - lastPendingEvent >= chrono::milliseconds(watchDebounceMilliseconds) || now - firstPendingEvent >= chrono::milliseconds(watchMaxBatchDelayMilliseconds)){
+                ApplyWatchBatch(removals, updates, images, matches);
+                isBatchOpen = false;
+            }
+        }
+    }
+    
+    close(inotifyFd);
+}
+
+//Reads each file, or only its first readLimit bytes when readLimit isn't 0, and hands the contents to consume on the
+//calling thread as reads complete.  Up to readQueueDepth reads and readMaxInFlightBytes of unconsumed data are in
+//flight at once, so decoding overlaps with I/O.  A failed read is reported with a NULL buffer.  With a budget, each
+//file's length plus its extraBytes entry (if any) is acquired before the read is issued and released once consume
+//returns, and read buffers are freed rather than kept for later files.
+void ReadFiles(const vector<string>& fileNames, size_t readLimit, const ReadCallback& consume, MemoryBudget* budget, const vector<long long>& extraBytes){
+    if(fileNames.empty()){
+        return;
+    }
+    vector<size_t> order(fileNames.size());
+    if(usesPhysicalOrder){
+        order = GetPhysicalOrder(fileNames);
+    }
+    else{
+        iota(order.begin(), order.end(), 0);
+    }
+    
+    if(usesMmap && readLimit == 0){
+        MapFiles(fileNames, order, consume, budget, extraBytes);
+        return;
+    }
+    if(usesIoUring && ReadFilesWithIoUring(fileNames, order, readLimit, consume, budget, extraBytes)){
+        return;
+    }
+    ReadFilesWithThreads(fileNames, order, readLimit, consume, budget, extraBytes);
 }
 
-vector<string> GetDirectoriesInDirectory(const string& path, bool isFirstLevel){
-    vector<string> directoryList;
-    DIR *dirPointer;
-    struct dirent *entry;
-    dirPointer = opendir(path.c_str());
-    if(dirPointer != NULL){
-        while ((entry = readdir(dirPointer)) != NULL){
-            if(entry->d_type == DT_DIR){
-                if(string(entry->d_name).compare(".") != 0 && string(entry->d_name).compare("..") != 0){
-                    string fullDirectory;
-                    if(isFirstLevel){
-                        fullDirectory = path + entry->d_name;
-                        directoryList.push_back(path + entry->d_name);
+//Maps each file read-only and passes the mapping itself to consume, unmapping it as soon as consume returns.  Up to
+//readQueueDepth files (and readMaxInFlightBytes) ahead are mapped with MADV_WILLNEED so the kernel reads them in
+//while earlier ones are decoded.
+void MapFiles(const vector<string>& fileNames, const vector<size_t>& order, const ReadCallback& consume, MemoryBudget* budget, const vector<long long>& extraBytes){
+    deque<MappedFile> mappedFiles;
+    deque<long long> charges;
+    long long mappedBytes = 0;
+    size_t next = 0;
+    
+    while(next < order.size() || !mappedFiles.empty()){
+        while(next < order.size() && (int)mappedFiles.size() < readQueueDepth){
+            const string& fileName = fileNames[order[next]];
+            MappedFile file;
+            file.index = order[next];
+            file.data = NULL;
+            file.length = 0;
+            
+            long long length = GetReadLength(fileName, 0);
+            if(!mappedFiles.empty() && mappedBytes + length > readMaxInFlightBytes){
+                break;
+            }
+            long long charge = max(length, 0LL) + (extraBytes.empty() ? 0 : extraBytes[order[next]]);
+            if(budget != NULL && !mappedFiles.empty() && !budget->TryAcquire(charge)){
+                break;
+            }
+            if(budget != NULL && mappedFiles.empty()){
+                budget->Acquire(charge);
+            }
+            charges.push_back(charge);
+            int fileDescriptor = length > 0 ? open(fileName.c_str(), O_RDONLY | O_CLOEXEC) : -1;
+            if(fileDescriptor >= 0){
+                void* mapping = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fileDescriptor, 0);
+                close(fileDescriptor);
+                if(mapping != MAP_FAILED){
+                    madvise(mapping, length, MADV_SEQUENTIAL);
+                    madvise(mapping, length, MADV_WILLNEED);
+                    file.data = mapping;
+                    file.length = length;
+                    mappedBytes += length;
+                }
+            }
+            mappedFiles.push_back(file);
+            next++;
+        }
+        
+        MappedFile& file = mappedFiles.front();
+        consume(file.index, (const unsigned char*)file.data, file.length);
+        if(file.data != NULL){
+            munmap(file.data, file.length);
+            mappedBytes -= file.length;
+        }
+        if(budget != NULL){
+            budget->Release(charges.front());
+        }
+        mappedFiles.pop_front();
+        charges.pop_front();
+    }
+}
+
+//Indices of fileNames sorted by where their data starts on disk, using the first FIEMAP extent when the filesystem
+//reports one and the inode number otherwise.  Locations are remembered so later passes over the same files don't
+//have to ask again.
+vector<size_t> GetPhysicalOrder(const vector<string>& fileNames){
+    vector<pair<unsigned long long, unsigned long long>> locations(fileNames.size());
+    for(size_t i = 0; i < fileNames.size(); i++){
+        {
+            lock_guard<mutex> lock(physicalLocationsMutex);
+            map<string, pair<unsigned long long, unsigned long long>>::iterator cached = physicalLocations.find(fileNames[i]);
+            if(cached != physicalLocations.end()){
+                locations[i] = cached->second;
+                continue;
+            }
+        }
+        
+        int fileDescriptor = open(fileNames[i].c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat fileStat;
+        if(fileDescriptor < 0 || fstat(fileDescriptor, &fileStat) != 0){
+            locations[i] = make_pair(numeric_limits<unsigned long long>::max(), 0ULL);
+        }
+        else{
+            locations[i] = make_pair((unsigned long long)fileStat.st_dev, (unsigned long long)fileStat.st_ino);
+            
+            unsigned char request[sizeof(struct fiemap) + sizeof(struct fiemap_extent)] = {};
+            struct fiemap* extentMap = (struct fiemap*)request;
+            extentMap->fm_length = FIEMAP_MAX_OFFSET;
+            extentMap->fm_extent_count = 1;
+            if(ioctl(fileDescriptor, FS_IOC_FIEMAP, extentMap) == 0 && extentMap->fm_mapped_extents > 0
+                && !(extentMap->fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE))){
+                locations[i].second = extentMap->fm_extents[0].fe_physical;
+            }
+        }
+        if(fileDescriptor >= 0){
+            close(fileDescriptor);
+        }
+        lock_guard<mutex> lock(physicalLocationsMutex);
+        physicalLocations[fileNames[i]] = locations[i];
+    }
+    
+    vector<size_t> order(fileNames.size());
+    iota(order.begin(), order.end(), 0);
+    stable_sort(order.begin(), order.end(), [&locations](size_t a, size_t b){ return locations[a] < locations[b]; });
+    return order;
+}
+
+//Number of bytes the I/O stage will read from fileName, or -1 if it can't be read
+long long GetReadLength(const string& fileName, size_t readLimit){
+    struct stat fileStat;
+    if(stat(fileName.c_str(), &fileStat) != 0 || !S_ISREG(fileStat.st_mode)){
+        return -1;
+    }
+    if(readLimit > 0 && fileStat.st_size > (long long)readLimit){
+        return readLimit;
+    }
+    return fileStat.st_size;
+}
+
+//Blocking read of whatever part of slot hasn't been read yet
+bool ReadSlotSynchronously(ReadSlot& slot){
+    while(slot.completed < slot.length){
+        ssize_t bytesRead = pread(slot.fileDescriptor, slot.buffer.data() + slot.completed, slot.length - slot.completed, slot.completed);
+        if(bytesRead < 0 && errno == EINTR){
+            continue;
+        }
+        if(bytesRead < 0){
+            return false;
+        }
+        if(bytesRead == 0){//the file shrank since it was measured
+            slot.length = slot.completed;
+        }
+        slot.completed += bytesRead;
+    }
+    return true;
+}
+
+bool OpenIoUring(IoUring& ring, unsigned entries){
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring.fileDescriptor = syscall(__NR_io_uring_setup, entries, &params);
+    if(ring.fileDescriptor < 0){
+        return false;
+    }
+    
+    ring.submissionRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.completionRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool isSingleMapping = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if(isSingleMapping){
+        ring.submissionRingSize = ring.completionRingSize = max(ring.submissionRingSize, ring.completionRingSize);
+    }
+    ring.submissionEntriesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    
+    ring.submissionRing = mmap(NULL, ring.submissionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fileDescriptor, IORING_OFF_SQ_RING);
+    ring.completionRing = isSingleMapping ? ring.submissionRing : mmap(NULL, ring.completionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fileDescriptor, IORING_OFF_CQ_RING);
+    void* submissionEntries = mmap(NULL, ring.submissionEntriesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fileDescriptor, IORING_OFF_SQES);
+    if(ring.submissionRing == MAP_FAILED || ring.completionRing == MAP_FAILED || submissionEntries == MAP_FAILED){
+        if(ring.submissionRing != MAP_FAILED){
+            munmap(ring.submissionRing, ring.submissionRingSize);
+        }
+        if(!isSingleMapping && ring.completionRing != MAP_FAILED){
+            munmap(ring.completionRing, ring.completionRingSize);
+        }
+        if(submissionEntries != MAP_FAILED){
+            munmap(submissionEntries, ring.submissionEntriesSize);
+        }
+        close(ring.fileDescriptor);
+        return false;
+    }
+    
+    char* submissionRing = (char*)ring.submissionRing;
+    char* completionRing = (char*)ring.completionRing;
+    ring.submissionTail = (unsigned*)(submissionRing + params.sq_off.tail);
+    ring.submissionMask = (unsigned*)(submissionRing + params.sq_off.ring_mask);
+    ring.submissionArray = (unsigned*)(submissionRing + params.sq_off.array);
+    ring.submissionEntries = (struct io_uring_sqe*)submissionEntries;
+    ring.completionHead = (unsigned*)(completionRing + params.cq_off.head);
+    ring.completionTail = (unsigned*)(completionRing + params.cq_off.tail);
+    ring.completionMask = (unsigned*)(completionRing + params.cq_off.ring_mask);
+    ring.completionEntries = (struct io_uring_cqe*)(completionRing + params.cq_off.cqes);
+    ring.isSingleMapping = isSingleMapping;
+    return true;
+}
+
+void CloseIoUring(IoUring& ring){
+    munmap(ring.submissionEntries, ring.submissionEntriesSize);
+    if(!ring.isSingleMapping){
+        munmap(ring.completionRing, ring.completionRingSize);
+    }
+    munmap(ring.submissionRing, ring.submissionRingSize);
+    close(ring.fileDescriptor);
+}
+
+//Queues a read of the rest of slot; submitted with the next io_uring_enter
+void QueueRead(IoUring& ring, ReadSlot& slot, unsigned long long slotIndex){
+    unsigned tail = *ring.submissionTail;
+    unsigned index = tail & *ring.submissionMask;
+    struct io_uring_sqe* entry = &ring.submissionEntries[index];
+    memset(entry, 0, sizeof(*entry));
+    slot.request.iov_base = slot.buffer.data() + slot.completed;
+    slot.request.iov_len = slot.length - slot.completed;
+    entry->opcode = IORING_OP_READV;
+    entry->fd = slot.fileDescriptor;
+    entry->addr = (unsigned long long)&slot.request;
+    entry->len = 1;
+    entry->off = slot.completed;
+    entry->user_data = slotIndex;
+    ring.submissionArray[index] = index;
+    __atomic_store_n(ring.submissionTail, tail + 1, __ATOMIC_RELEASE);
+}
+
+bool ReadFilesWithIoUring(const vector<string>& fileNames, const vector<size_t>& order, size_t readLimit, const ReadCallback& consume, MemoryBudget* budget, const vector<long long>& extraBytes){
+    unsigned queueDepth = max(1, readQueueDepth);
+    size_t retainedLength = readMaxInFlightBytes / queueDepth;//larger buffers are freed rather than pooled
+    IoUring ring;
+    if(!OpenIoUring(ring, queueDepth)){
+        return false;
+    }
+    
+    vector<ReadSlot> slots(queueDepth);
+    vector<bool> isQueued(queueDepth, false);//a read of the slot was handed to the ring and hasn't completed
+    vector<unsigned> freeSlots;
+    for(unsigned i = queueDepth; i > 0; i--){
+        freeSlots.push_back(i - 1);
+    }
+    
+    size_t next = 0;
+    unsigned activeCount = 0;
+    unsigned unsubmittedCount = 0;
+    long long inFlightBytes = 0;
+    bool isRingUsable = true;
+    
+    auto finish = [&](unsigned slotIndex, bool isValid){
+        ReadSlot& slot = slots[slotIndex];
+        close(slot.fileDescriptor);
+        consume(slot.index, isValid ? slot.buffer.data() : NULL, slot.completed);
+        if(budget != NULL || slot.buffer.capacity() > retainedLength){
+            vector<unsigned char>().swap(slot.buffer);
+        }
+        if(budget != NULL){
+            budget->Release(slot.charge);
+        }
+        inFlightBytes -= slot.length;
+        activeCount--;
+        freeSlots.push_back(slotIndex);
+    };
+    
+    while(next < fileNames.size() || activeCount > 0){
+        while(next < fileNames.size() && !freeSlots.empty()){
+            const string& fileName = fileNames[order[next]];
+            long long length = GetReadLength(fileName, readLimit);
+            if(activeCount > 0 && inFlightBytes + length > readMaxInFlightBytes){
+                break;
+            }
+            //only wait for the budget with nothing of our own outstanding, since this thread is the one that releases it
+            long long charge = max(length, 0LL) + (extraBytes.empty() ? 0 : extraBytes[order[next]]);
+            if(budget != NULL && activeCount > 0 && !budget->TryAcquire(charge)){
+                break;
+            }
+            if(budget != NULL && activeCount == 0){
+                budget->Acquire(charge);
+            }
+            int fileDescriptor = length < 0 ? -1 : open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+            if(fileDescriptor < 0){
+                consume(order[next++], NULL, 0);
+                if(budget != NULL){
+                    budget->Release(charge);
+                }
+                continue;
+            }
+            
+            unsigned slotIndex = freeSlots.back();
+            freeSlots.pop_back();
+            ReadSlot& slot = slots[slotIndex];
+            slot.index = order[next++];
+            slot.fileDescriptor = fileDescriptor;
+            slot.length = length;
+            slot.completed = 0;
+            slot.charge = charge;
+            if(slot.buffer.size() < slot.length){
+                slot.buffer.resize(slot.length);
+            }
+            activeCount++;
+            inFlightBytes += slot.length;
+            
+            if(!isRingUsable || slot.length == 0){
+                finish(slotIndex, ReadSlotSynchronously(slot));
+                continue;
+            }
+            QueueRead(ring, slot, slotIndex);
+            isQueued[slotIndex] = true;
+            unsubmittedCount++;
+        }
+        
+        if(activeCount == 0){
+            continue;
+        }
+        
+        int submitted = syscall(__NR_io_uring_enter, ring.fileDescriptor, unsubmittedCount, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if(submitted < 0){
+            if(errno == EINTR || errno == EAGAIN || errno == EBUSY){
+                continue;
+            }
+            //finish what's outstanding with blocking reads once the ring stops working
+            cout << "io_uring failed (" << strerror(errno) << "), continuing with blocking reads.\n";
+            isRingUsable = false;
+            
+            //reads the kernel already accepted may still write into their buffers, so wait for them first
+            unsigned outstandingCount = activeCount - unsubmittedCount;
+            while(outstandingCount > 0){
+                if(syscall(__NR_io_uring_enter, ring.fileDescriptor, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR){
+                    break;
+                }
+                unsigned head = *ring.completionHead;
+                while(head != __atomic_load_n(ring.completionTail, __ATOMIC_ACQUIRE)){
+                    struct io_uring_cqe* completion = &ring.completionEntries[head & *ring.completionMask];
+                    unsigned slotIndex = completion->user_data;
+                    if(completion->res > 0){
+                        slots[slotIndex].completed += completion->res;
                     }
-                    else{
-                        fullDirectory = path + "/" + entry->d_name;
-                        directoryList.push_back(path + "/" + entry->d_name);
+                    head++;
+                    __atomic_store_n(ring.completionHead, head, __ATOMIC_RELEASE);
+                    isQueued[slotIndex] = false;
+                    outstandingCount--;
+                }
+            }
+            for(unsigned i = 0; i < slots.size(); i++){
+                if(find(freeSlots.begin(), freeSlots.end(), i) == freeSlots.end()){
+                    if(outstandingCount > 0 && isQueued[i]){
+                        //the kernel may still own this buffer, so it is never freed and the read starts over in a new one
+                        (new vector<unsigned char>())->swap(slots[i].buffer);
+                        slots[i].buffer.resize(slots[i].length);
+                        slots[i].completed = 0;
                     }
-                    //cout << "Found directory: " << fullDirectory << "\n";
+                    isQueued[i] = false;
+                    finish(i, ReadSlotSynchronously(slots[i]));
                 }
-            }       
+            }
+            continue;
+        }
+        unsubmittedCount -= min((unsigned)submitted, unsubmittedCount);
+        
+        unsigned head = *ring.completionHead;
+        while(head != __atomic_load_n(ring.completionTail, __ATOMIC_ACQUIRE)){
+            struct io_uring_cqe* completion = &ring.completionEntries[head & *ring.completionMask];
+            unsigned slotIndex = completion->user_data;
+            int result = completion->res;
+            head++;
+            __atomic_store_n(ring.completionHead, head, __ATOMIC_RELEASE);
+            
+            ReadSlot& slot = slots[slotIndex];
+            isQueued[slotIndex] = false;
+            if(result == -EINTR || result == -EAGAIN){
+                QueueRead(ring, slot, slotIndex);
+                isQueued[slotIndex] = true;
+                unsubmittedCount++;
+            }
+            else if(result < 0){
+                finish(slotIndex, false);
+            }
+            else{
+                if(result == 0){//the file shrank since it was measured
+                    slot.length = slot.completed;
+                }
+                slot.completed += result;
+                if(slot.completed < slot.length){
+                    QueueRead(ring, slot, slotIndex);
+                    isQueued[slotIndex] = true;
+                    unsubmittedCount++;
+                }
+                else{
+                    finish(slotIndex, true);
+                }
+            }
         }
     }
-    closedir(dirPointer);
-    return directoryList;
+    
+    CloseIoUring(ring);
+    return true;
+}
+
+//Fallback for kernels without io_uring: readQueueDepth threads doing blocking preads into the same pooled slots
+void ReadFilesWithThreads(const vector<string>& fileNames, const vector<size_t>& order, size_t readLimit, const ReadCallback& consume, MemoryBudget* budget, const vector<long long>& extraBytes){
+    unsigned queueDepth = max(1, readQueueDepth);
+    size_t retainedLength = readMaxInFlightBytes / queueDepth;//larger buffers are freed rather than pooled
+    vector<ReadSlot> slots(queueDepth);
+    vector<ReadSlot*> freeSlots;
+    for(ReadSlot& slot : slots){
+        freeSlots.push_back(&slot);
+    }
+    deque<pair<ReadSlot*, bool>> completedSlots;
+    size_t next = 0;
+    long long inFlightBytes = 0;
+    mutex stateMutex;
+    condition_variable stateChanged;
+    
+    auto readNext = [&](){
+        unique_lock<mutex> lock(stateMutex);
+        while(true){
+            stateChanged.wait(lock, [&](){ return next >= fileNames.size() || !freeSlots.empty(); });
+            if(next >= fileNames.size()){
+                return;
+            }
+            ReadSlot* slot = freeSlots.back();
+            freeSlots.pop_back();
+            slot->index = order[next++];
+            lock.unlock();
+            
+            long long length = GetReadLength(fileNames[slot->index], readLimit);
+            lock.lock();
+            stateChanged.wait(lock, [&](){ return inFlightBytes == 0 || inFlightBytes + max(length, 0LL) <= readMaxInFlightBytes; });
+            slot->length = max(length, 0LL);
+            slot->completed = 0;
+            slot->charge = slot->length + (extraBytes.empty() ? 0 : extraBytes[slot->index]);
+            inFlightBytes += slot->length;
+            lock.unlock();
+            if(budget != NULL){
+                budget->Acquire(slot->charge);
+            }
+            
+            bool isValid = false;
+            if(length >= 0 && (slot->fileDescriptor = open(fileNames[slot->index].c_str(), O_RDONLY | O_CLOEXEC)) >= 0){
+                if(slot->buffer.size() < slot->length){
+                    slot->buffer.resize(slot->length);
+                }
+                isValid = ReadSlotSynchronously(*slot);
+                close(slot->fileDescriptor);
+            }
+            
+            lock.lock();
+            completedSlots.push_back(make_pair(slot, isValid));
+            stateChanged.notify_all();
+        }
+    };
+    
+    vector<thread> threads;
+    for(unsigned i = 0; i < min((size_t)queueDepth, fileNames.size()); i++){
+        threads.push_back(thread(readNext));
+    }
+    
+    for(size_t consumedCount = 0; consumedCount < fileNames.size(); consumedCount++){
+        unique_lock<mutex> lock(stateMutex);
+        stateChanged.wait(lock, [&](){ return !completedSlots.empty(); });
+        ReadSlot* slot = completedSlots.front().first;
+        bool isValid = completedSlots.front().second;
+        completedSlots.pop_front();
+        lock.unlock();
+        
+        consume(slot->index, isValid ? slot->buffer.data() : NULL, slot->completed);
+        if(budget != NULL || slot->buffer.capacity() > retainedLength){
+            vector<unsigned char>().swap(slot->buffer);
+        }
+        if(budget != NULL){
+            budget->Release(slot->charge);
+        }
+        
+        lock.lock();
+        inFlightBytes -= slot->length;
+        freeSlots.push_back(slot);
+        stateChanged.notify_all();
+    }
+    
+    for(thread& worker : threads){
+        worker.join();
+    }
+}
+
+//Applies batchAction to every match group, leaving the file keepPolicy picks.  Actions run on batchThreadCount
+//threads; each completed one is appended to the journal, so rerunning with the same journal picks up where an
+//interrupted run stopped.
+void RunBatchActions(const vector<Image>& images, const vector<Pairing>& matches){
+    vector<vector<Image>> groups = GroupMatches(images, matches);
+    vector<pair<string, string>> actions;//target, keeper
+    for(const vector<Image>& group : groups){
+        size_t keeper = ChooseKeeper(group);
+        for(size_t i = 0; i < group.size(); i++){
+            if(i != keeper){
+                actions.push_back(make_pair(group[i].fileName, group[keeper].fileName));
+            }
+        }
+    }
+    
+    set<string> journaled;
+    ofstream journal;
+    if(journalFileName.size() > 0){
+        ifstream previousJournal(journalFileName.c_str());
+        string line;
+        while(getline(previousJournal, line)){
+            size_t firstTab = line.find('\t');
+            size_t secondTab = line.find('\t', firstTab + 1);
+            if(firstTab != string::npos && secondTab != string::npos && line.compare(0, firstTab, batchActionNames[batchAction]) == 0){
+                journaled.insert(line.substr(firstTab + 1, secondTab - firstTab - 1));
+            }
+        }
+        if(!isDryRun){
+            journal.open(journalFileName.c_str(), ios::app);
+        }
+    }
+    
+    cout << groups.size() << " group(s), " << actions.size() << " file(s) to " << batchActionNames[batchAction] << (isDryRun ? " (dry run)" : "") << ".\n";
+    
+    atomic<size_t> next(0);
+    int doneCount = 0, failedCount = 0, skippedCount = 0, differentCount = 0;
+    long long reclaimedBytes = 0;
+    mutex outputMutex;
+    auto work = [&](){
+        for(size_t i = next++; i < actions.size(); i = next++){
+            const string& target = actions[i].first;
+            const string& keeper = actions[i].second;
+            if(journaled.count(target) > 0){
+                lock_guard<mutex> lock(outputMutex);
+                skippedCount++;
+                continue;
+            }
+            
+            //Links replace the target's contents with the keeper's, so only byte-identical files may be linked.  Matches
+            //are perceptual and exact duplicate groups only share a hash, so the bytes are compared here.
+            if((batchAction == batchActionHardlink || batchAction == batchActionReflink) && !HasSameContents(target, keeper)){
+                lock_guard<mutex> lock(outputMutex);
+                differentCount++;
+                cout << "Skipping " << target << ": its contents differ from " << keeper << ", so it can't be replaced by a " << batchActionNames[batchAction] << "\n";
+                continue;
+            }
+            
+            //a file with other links keeps its data when this name goes
+            struct stat targetInfo;
+            long long targetSize = stat(target.c_str(), &targetInfo) == 0 && targetInfo.st_nlink == 1 ? targetInfo.st_size : 0;
+            string error;
+            bool isDone = isDryRun || ApplyBatchAction(target, keeper, error);
+            
+            lock_guard<mutex> lock(outputMutex);
+            if(!isDone){
+                failedCount++;
+                cout << "Unable to " << batchActionNames[batchAction] << " " << target << ": " << error << "\n";
+                continue;
+            }
+            doneCount++;
+            reclaimedBytes += batchAction == batchActionQuarantine ? 0 : targetSize;
+            cout << (isDryRun ? "Would " : "") << batchActionNames[batchAction] << " " << target << " (keeping " << keeper << ")\n";
+            if(journal.is_open()){
+                journal << batchActionNames[batchAction] << "\t" << target << "\t" << keeper << "\n" << flush;
+            }
+        }
+    };
+    
+    vector<thread> threads;
+    for(int i = 1; i < batchThreadCount; i++){
+        threads.push_back(thread(work));
+    }
+    work();
+    for(thread& worker : threads){
+        worker.join();
+    }
+    
+    cout << doneCount << " file(s) " << (isDryRun ? "would be " : "") << "processed, " << failedCount << " failed, " << differentCount << " not byte-identical to their keeper, "
+        << skippedCount << " already done according to the journal.  "
+        << reclaimedBytes / (1 << 20) << " MB " << (isDryRun ? "would be " : "") << "reclaimed.\n";
+}
+
+//Files linked by matches, transitively, form one group.  Groups and their members are in file name order.
+vector<vector<Image>> GroupMatches(const vector<Image>& images, const vector<Pairing>& matches){
+    vector<unsigned> parents(images.size());
+    iota(parents.begin(), parents.end(), 0);
+    function<unsigned(unsigned)> findRoot = [&](unsigned index){
+        if(parents[index] != index){
+            parents[index] = findRoot(parents[index]);
+        }
+        return parents[index];
+    };
+    vector<bool> isMatched(images.size(), false);
+    for(const Pairing& match : matches){
+        if(images[match.image1].fileName.size() == 0 || images[match.image2].fileName.size() == 0){
+            continue;
+        }
+        isMatched[match.image1] = true;
+        isMatched[match.image2] = true;
+        unsigned root1 = findRoot(match.image1);
+        unsigned root2 = findRoot(match.image2);
+        if(root1 != root2){
+            parents[root2] = root1;
+        }
+    }
+    
+    map<unsigned, vector<Image>> groupsByRoot;
+    for(size_t i = 0; i < images.size(); i++){
+        if(isMatched[i]){
+            groupsByRoot[findRoot(i)].push_back(images[i]);
+        }
+    }
+    vector<vector<Image>> groups;
+    for(auto& group : groupsByRoot){
+        sort(group.second.begin(), group.second.end(), [](const Image& a, const Image& b){ return a.fileName < b.fileName; });
+        groups.push_back(move(group.second));
+    }
+    sort(groups.begin(), groups.end(), [](const vector<Image>& a, const vector<Image>& b){ return a[0].fileName < b[0].fileName; });
+    return groups;
+}
+
+//Index of the file keepPolicy prefers; ties go to the first file name in sorted order
+size_t ChooseKeeper(const vector<Image>& group){
+    size_t keeper = 0;
+    vector<long long> modificationTimes(group.size(), numeric_limits<long long>::max());
+    for(size_t i = 0; i < group.size(); i++){
+        struct stat fileInfo;
+        if(stat(group[i].fileName.c_str(), &fileInfo) == 0){
+            modificationTimes[i] = fileInfo.st_mtime;
+        }
+    }
+    for(size_t i = 1; i < group.size(); i++){
+        bool isBetter = false;
+        if(keepPolicy == keepHighestResolution){
+            isBetter = (long long)group[i].width * group[i].height > (long long)group[keeper].width * group[keeper].height;
+        }
+        else if(keepPolicy == keepOldest){
+            isBetter = modificationTimes[i] < modificationTimes[keeper];
+        }
+        else if(keepPolicy == keepShortestPath){
+            isBetter = group[i].fileName.size() < group[keeper].fileName.size();
+        }
+        if(isBetter){
+            keeper = i;
+        }
+    }
+    return keeper;
+}
+
+bool ApplyBatchAction(const string& target, const string& keeper, string& error){
+    if(batchAction == batchActionDelete){
+        if(unlink(target.c_str()) != 0){
+            error = strerror(errno);
+            return false;
+        }
+        return true;
+    }
+    if(batchAction == batchActionQuarantine){
+        string destination = quarantineDirectory;
+        for(const string& segment : GetAbsolutePathSegments(target)){
+            destination = JoinPath(destination, segment);
+        }
+        if(!MakeDirectories(destination.substr(0, destination.rfind('/')))){
+            error = strerror(errno);
+            return false;
+        }
+        return MoveFile(target, destination, error);
+    }
+    return ReplaceWithClone(target, keeper, error);
+}
+
+//Swaps target for a hardlink or reflink to keeper.  The link is made under a temporary name next to target and
+//renamed over it, so target is never missing.
+bool ReplaceWithClone(const string& target, const string& keeper, string& error){
+    struct stat targetInfo, keeperInfo;
+    if(stat(target.c_str(), &targetInfo) != 0 || stat(keeper.c_str(), &keeperInfo) != 0){
+        error = strerror(errno);
+        return false;
+    }
+    if(targetInfo.st_dev == keeperInfo.st_dev && targetInfo.st_ino == keeperInfo.st_ino){
+        return true;//already the same file
+    }
+    
+    string temporaryName = target + ".difdif-tmp";
+    unlink(temporaryName.c_str());
+    if(batchAction == batchActionHardlink){
+        if(link(keeper.c_str(), temporaryName.c_str()) != 0){
+            error = strerror(errno);
+            return false;
+        }
+    }
+    else{
+        int source = open(keeper.c_str(), O_RDONLY | O_CLOEXEC);
+        int destination = open(temporaryName.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, targetInfo.st_mode & 07777);
+        bool isCloned = source >= 0 && destination >= 0 && ioctl(destination, FICLONE, source) == 0;
+        if(!isCloned){
+            error = errno == EOPNOTSUPP || errno == EXDEV || errno == EINVAL ? "the filesystem can't reflink these files" : strerror(errno);
+        }
+        if(source >= 0){
+            close(source);
+        }
+        if(destination >= 0){
+            close(destination);
+        }
+        if(!isCloned){
+            unlink(temporaryName.c_str());
+            return false;
+        }
+    }
+    
+    if(rename(temporaryName.c_str(), target.c_str()) != 0){
+        error = strerror(errno);
+        unlink(temporaryName.c_str());
+        return false;
+    }
+    return true;
+}
+
+//True when both files can be read and hold exactly the same bytes
+bool HasSameContents(const string& fileName1, const string& fileName2){
+    struct stat info1, info2;
+    int file1 = open(fileName1.c_str(), O_RDONLY | O_CLOEXEC);
+    int file2 = open(fileName2.c_str(), O_RDONLY | O_CLOEXEC);
+    bool isSame = file1 >= 0 && file2 >= 0 && fstat(file1, &info1) == 0 && fstat(file2, &info2) == 0 && info1.st_size == info2.st_size;
+    vector<char> buffer1(1 << 20), buffer2(1 << 20);
+    while(isSame){
+        ssize_t bytesRead1 = read(file1, buffer1.data(), buffer1.size());
+        if(bytesRead1 == 0){
+            break;
+        }
+        ssize_t bytesRead2 = bytesRead1 > 0 ? read(file2, buffer2.data(), bytesRead1) : -1;
+        isSame = bytesRead1 > 0 && bytesRead2 == bytesRead1 && memcmp(buffer1.data(), buffer2.data(), bytesRead1) == 0;
+    }
+    if(file1 >= 0){
+        close(file1);
+    }
+    if(file2 >= 0){
+        close(file2);
+    }
+    return isSame;
+}
+
+//rename, or a copy and unlink when destination is on another filesystem
+bool MoveFile(const string& source, const string& destination, string& error){
+    if(rename(source.c_str(), destination.c_str()) == 0){
+        return true;
+    }
+    if(errno != EXDEV){
+        error = strerror(errno);
+        return false;
+    }
+    
+    struct stat sourceInfo;
+    int input = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    int output = input >= 0 && fstat(input, &sourceInfo) == 0 ? open(destination.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, sourceInfo.st_mode & 07777) : -1;
+    bool isCopied = output >= 0;
+    vector<char> buffer(1 << 20);
+    ssize_t bytesRead;
+    while(isCopied && (bytesRead = read(input, buffer.data(), buffer.size())) != 0){
+        isCopied = bytesRead > 0 && write(output, buffer.data(), bytesRead) == bytesRead;
+    }
+    isCopied = isCopied && fsync(output) == 0;
+    if(!isCopied){
+        error = strerror(errno);
+    }
+    if(input >= 0){
+        close(input);
+    }
+    if(output >= 0){
+        close(output);
+        if(!isCopied){
+            unlink(destination.c_str());
+        }
+    }
+    if(isCopied && unlink(source.c_str()) != 0){
+        error = strerror(errno);
+        return false;
+    }
+    return isCopied;
+}
+
+bool MakeDirectories(const string& path){
+    for(size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1)){
+        string prefix = path.substr(0, slash);
+        if(prefix.size() > 0 && mkdir(prefix.c_str(), 0777) != 0 && errno != EEXIST){
+            return false;
+        }
+        if(slash == string::npos){
+            return true;
+        }
+    }
+}
+
+//Binary output starts with "DDM1", the image count, then per image its width, height and name (length-prefixed);
+//every match after that is 12 bytes: both images' indices and the similarity as a float, all little-endian.
+//Exact copies are listed after the profiled images.
+string GetOutputHeader(const vector<Image>& images, const vector<Image>& copies){
+    string header;
+    if(outputFormat == outputFormatCsv){
+        header = "image1,image2,similarity,width1,height1,width2,height2\n";
+    }
+    else if(outputFormat == outputFormatBinary){
+        header = "DDM1";
+        AppendLittleEndian(header, images.size() + copies.size(), 4);
+        for(const vector<Image>* list : {&images, &copies}){
+            for(const Image& image : *list){
+                AppendLittleEndian(header, image.width, 4);
+                AppendLittleEndian(header, image.height, 4);
+                AppendLittleEndian(header, image.fileName.size(), 2);
+                header += image.fileName;
+            }
+        }
+    }
+    return header;
+}
+
+void AppendMatchRecord(string& buffer, const Image& image1, const Image& image2, float similarity, unsigned index1, unsigned index2){
+    //Kept matches only hold hundredths of a percent, so streamed ones are rounded the same way
+    similarity = lround(similarity * 100) / 100.0f;
+    char number[32];
+    snprintf(number, sizeof(number), "%.2f", similarity);
+    if(outputFormat == outputFormatJsonLines){
+        buffer += "{\"image1\":\"" + EscapeJson(image1.fileName) + "\",\"image2\":\"" + EscapeJson(image2.fileName) + "\",\"similarity\":" + number
+            + ",\"width1\":" + to_string(image1.width) + ",\"height1\":" + to_string(image1.height)
+            + ",\"width2\":" + to_string(image2.width) + ",\"height2\":" + to_string(image2.height) + "}\n";
+    }
+    else if(outputFormat == outputFormatCsv){
+        buffer += EscapeCsv(image1.fileName) + "," + EscapeCsv(image2.fileName) + "," + number + "," + to_string(image1.width) + "," + to_string(image1.height)
+            + "," + to_string(image2.width) + "," + to_string(image2.height) + "\n";
+    }
+    else{
+        uint32_t similarityBits;
+        memcpy(&similarityBits, &similarity, 4);
+        AppendLittleEndian(buffer, index1, 4);
+        AppendLittleEndian(buffer, index2, 4);
+        AppendLittleEndian(buffer, similarityBits, 4);
+    }
+}
+
+string EscapeJson(const string& text){
+    string escaped;
+    for(unsigned char c : text){
+        if(c == '"' || c == '\\'){
+            escaped += '\\';
+            escaped += c;
+        }
+        else if(c < 0x20){
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", c);
+            escaped += code;
+        }
+        else{
+            escaped += c;
+        }
+    }
+    return escaped;
 }
 
+//Quoted only when it has to be, with quotes doubled (RFC 4180)
+string EscapeCsv(const string& text){
+    if(text.find_first_of(",\"\r\n") == string::npos){
+        return text;
+    }
+    string escaped = "\"";
+    for(char c : text){
+        escaped += c;
+        if(c == '"'){
+            escaped += '"';
+        }
+    }
+    return escaped + "\"";
+}
+
+void AppendLittleEndian(string& buffer, unsigned long long value, int byteCount){
+    for(int i = 0; i < byteCount; i++){
+        buffer += (char)(value >> (8 * i));
+    }
+}
+
+unsigned long long ReadLittleEndian(istream& input, int byteCount){
+    unsigned char bytes[8] = {};
+    input.read((char*)bytes, byteCount);
+    unsigned long long value = 0;
+    for(int i = byteCount - 1; i >= 0; i--){
+        value = value << 8 | bytes[i];
+    }
+    return value;
+}
+
+//Identifies the comparison a checkpoint belongs to: the images in order (names, sizes and profiles) and the
+//settings that decide which pairs were recorded
+string GetCheckpointHeader(const vector<Image>& images, int recordedSimilarity){
+    unsigned long long hash = 0;
+    for(const Image& image : images){
+        hash = HashBytes((const unsigned char*)image.fileName.data(), image.fileName.size(), hash);
+        int size[] = {image.width, image.height};
+        hash = HashBytes((const unsigned char*)size, sizeof(size), hash);
+        for(const vector<int>& row : image.smallProfile){
+            hash = HashBytes((const unsigned char*)row.data(), row.size() * sizeof(int), hash);
+        }
+    }
+    uint32_t penaltyBits;
+    memcpy(&penaltyBits, &aspectRatioPenalty, 4);
+    string header = "DDC1";
+    AppendLittleEndian(header, images.size(), 4);
+    AppendLittleEndian(header, hash, 8);
+    AppendLittleEndian(header, compareTileRows, 4);
+    AppendLittleEndian(header, recordedSimilarity, 2);
+    AppendLittleEndian(header, usesAspectRatioPenalty ? penaltyBits : 0, 4);
+    return header;
+}
+
+//Workers finish the tile they are on and stop; a second signal gets the default action
+void StopComparisons(int signalNumber){
+    isInterrupted = true;
+    signal(signalNumber, SIG_DFL);
+}